@@ -0,0 +1,93 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+
+#include "include/af_image_threads.h"
+
+
+// PNG through unmodified stb_image_write, defined in bench_stb.cpp
+bool writePngStock(std::vector<unsigned char> &out, const unsigned char* data, int width, int height, int channels, int stride);
+
+// Encode and decode throughput per format: every format is written into memory and read back a few times, with the default and the
+// fastest settings
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "assets/nyc.jpg";
+    const int runs = 3;
+
+    af::Image image;
+    image.load(path);
+
+    if(image.getImage() == nullptr)
+    {
+        std::cout << "Could not load " << path << "\n";
+        return 1;
+    }
+
+    double megabytes = (double)image.getWidth() * image.getHeight() * image.getChannels() / (1024.0 * 1024.0);
+    af::ImageFormat formats[] = {af::ImageFormat::Jpeg, af::ImageFormat::Png, af::ImageFormat::Bmp, af::ImageFormat::Tga,
+                                 af::ImageFormat::Ppm, af::ImageFormat::Pfm, af::ImageFormat::Qoi,
+                                 af::ImageFormat::AfRaw};
+
+    printf("%s: %dx%d, %d channels, %.1f MB\n\n", path, image.getWidth(), image.getHeight(), image.getChannels(), megabytes);
+    printf("%-8s %-10s %12s %12s %12s\n", "format", "settings", "encode MB/s", "decode MB/s", "size (KB)");
+
+    // Encode runs times with encode(output), decode the result as often and print a row
+    auto measure = [&](const char* name, const char* settings, bool decodable, auto encode) {
+        std::vector<unsigned char> output;
+        double best = 0;
+
+        for(int run = 0; run < runs; run++)
+        {
+            output.clear();
+            auto start = std::chrono::high_resolution_clock::now();
+            encode(output);
+            double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            best = std::max(best, megabytes / seconds);
+        }
+
+        double best_decode = 0;
+
+        for(int run = 0; run < runs && decodable; run++)
+        {
+            af::Image decoded;
+            auto start = std::chrono::high_resolution_clock::now();
+            bool ok = decoded.loadFromMemory(output.data(), output.size());
+            double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            best_decode = ok ? std::max(best_decode, megabytes / seconds) : 0;
+        }
+
+        char decode[32] = "-";
+
+        if(best_decode > 0)
+        {
+            snprintf(decode, sizeof(decode), "%.1f", best_decode);
+        }
+
+        printf("%-8s %-10s %12.1f %12s %12zu\n", name, settings, best, decode, output.size() / 1024);
+    };
+
+    for(af::ImageFormat format : formats)
+    {
+        for(int fastest = 0; fastest < 2; fastest++)
+        {
+            af::WriteOptions options = fastest ? af::WriteOptions::fastest() : af::WriteOptions();
+            options.format = format;
+
+            // Decoding from memory, .afraw is only read by mapping files
+            measure(af::formatName(format), fastest ? "fastest" : "default", format != af::ImageFormat::AfRaw, [&](std::vector<unsigned char> &output) {
+                af::BufferedWriter writer(&output);
+                image.write(&writer, options);
+                writer.close();
+            });
+        }
+    }
+
+    // Baseline: stbi_write_png with its own deflate, the PNG rows above go through the parallel one
+    measure("png", "stock stb", true, [&](std::vector<unsigned char> &output) {
+        writePngStock(output, image.getImage(), image.getWidth(), image.getHeight(), image.getChannels(), image.getStride());
+    });
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#include <vector>
+
+// Stock stb_image_write in a translation unit of its own: without STBIW_ZLIB_COMPRESS its PNG writer uses the builtin deflate instead
+// of the parallel one af_image_threads.h plugs in. Everything is static, so it does not clash with the copy in bench.cpp.
+#define STB_IMAGE_WRITE_STATIC
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "include/stb_image_write.h"
+
+
+static void appendBytes(void* context, void* data, int size)
+{
+    std::vector<unsigned char>* out = (std::vector<unsigned char>*)context;
+    out->insert(out->end(), (unsigned char*)data, (unsigned char*)data + size);
+}
+
+// Write a PNG into memory with unmodified stb_image_write (compression level 8)
+bool writePngStock(std::vector<unsigned char> &out, const unsigned char* data, int width, int height, int channels, int stride)
+{
+    return stbi_write_png_to_func(appendBytes, &out, width, height, channels, data, stride) != 0;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define AF_HAS_AFRAW_IO 1
+#endif
+
+
+namespace af
+{
+    // Native uncompressed format (.afraw): this header, zero padding up to data_offset, then height rows of stride bytes each.
+    // data_offset is a multiple of the page size, so a mapped file keeps the row alignment of the image it was written from.
+    struct AfRawHeader
+    {
+        char magic[8];          // "AFRAW" followed by zeros
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
+        uint32_t stride;        // Bytes per row including the row padding
+        uint32_t alignment;     // Row alignment the stride was chosen for
+        uint64_t data_offset;   // File offset of the first row
+        uint64_t data_size;     // stride * height
+    };
+
+    const char AFRAW_MAGIC[8] = {'A', 'F', 'R', 'A', 'W', 0, 0, 0};
+    const uint32_t AFRAW_VERSION = 1;
+    const uint64_t AFRAW_DATA_OFFSET = 4096;
+
+    // Check a header read from a file against the file size. The sizes are read back as int, and the checks are written so that
+    // nothing can overflow for a crafted header.
+    inline bool afRawHeaderValid(const AfRawHeader &header, uint64_t file_size)
+    {
+        return memcmp(header.magic, AFRAW_MAGIC, sizeof(AFRAW_MAGIC)) == 0 &&
+               header.version == AFRAW_VERSION &&
+               header.width > 0 && header.width <= INT_MAX &&
+               header.height > 0 && header.height <= INT_MAX &&
+               header.stride <= INT_MAX &&
+               header.channels > 0 && header.channels <= 4 &&
+               header.stride >= (uint64_t)header.width * header.channels &&
+               header.data_size == (uint64_t)header.stride * header.height &&
+               header.data_offset >= sizeof(AfRawHeader) &&
+               header.data_size <= file_size && header.data_offset <= file_size - header.data_size;
+    }
+
+    // Build the header of an .afraw file
+    inline AfRawHeader makeAfRawHeader(int width, int height, int channels, int stride, int alignment)
+    {
+        AfRawHeader header = {};
+        memcpy(header.magic, AFRAW_MAGIC, sizeof(AFRAW_MAGIC));
+        header.version = AFRAW_VERSION;
+        header.width = width;
+        header.height = height;
+        header.channels = channels;
+        header.stride = stride;
+        header.alignment = alignment;
+        header.data_offset = AFRAW_DATA_OFFSET;
+        header.data_size = (uint64_t)stride * height;
+        return header;
+    }
+
+#if defined(AF_HAS_AFRAW_IO)
+    // write() until everything is out (or an error occurs)
+    inline bool writeAll(int fd, const unsigned char* data, size_t size)
+    {
+        while(size > 0)
+        {
+            ssize_t written = ::write(fd, data, size);
+
+            if(written <= 0)
+            {
+                return false;
+            }
+
+            data += written;
+            size -= (size_t)written;
+        }
+
+        return true;
+    }
+
+    // Write an .afraw file: header and padding in one write, the rows (including their padding) in a second one
+    inline bool writeAfRaw(const char* path, const unsigned char* data, int width, int height, int channels, int stride, int alignment)
+    {
+        AfRawHeader header = makeAfRawHeader(width, height, channels, stride, alignment);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if(fd < 0)
+        {
+            return false;
+        }
+
+        unsigned char head[AFRAW_DATA_OFFSET] = {};
+        memcpy(head, &header, sizeof(header));
+        bool ok = writeAll(fd, head, sizeof(head)) && writeAll(fd, data, header.data_size);
+        ok = (close(fd) == 0) && ok;
+        return ok;
+    }
+#endif
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define AF_HAS_MMAN 1
+#endif
+
+
+namespace af
+{
+    // Where the pixel buffer of an image comes from
+    enum class AllocPolicy
+    {
+        Malloc,     // aligned_alloc
+        HugePages,  // Anonymous mmap aligned to 2 MiB with MADV_HUGEPAGE (transparent huge pages), falls back to Malloc
+        HugeTlb     // Explicit MAP_HUGETLB pages (needs reserved huge pages), falls back to HugePages
+    };
+
+    struct AllocOptions
+    {
+        AllocPolicy policy = AllocPolicy::Malloc;
+        bool prefault = false;      // Touch every page right away, spread over prefault_threads threads (first touch by the workers)
+        int prefault_threads = 0;   // 0 = hardware_concurrency
+        bool lock = false;          // mlock the buffer, for latency critical deployments (needs RLIMIT_MEMLOCK)
+    };
+
+    // A buffer together with what is needed to give it back
+    struct Allocation
+    {
+        unsigned char* data = nullptr;
+        size_t size = 0;            // Requested size
+        void* mapping = nullptr;    // Start of the mmap'ed range, nullptr if the buffer came from aligned_alloc
+        size_t mapping_size = 0;
+        bool locked = false;
+        bool huge = false;          // Huge pages were requested successfully (madvise or MAP_HUGETLB)
+    };
+
+
+    const size_t HUGE_PAGE_SIZE = (size_t)2 << 20;
+
+    // Write one byte per page, parallel over threads, so the page faults are taken now (and by the threads which will work on the memory)
+    inline void prefault(unsigned char* data, size_t size, int threads = 0)
+    {
+        const size_t page = 4096;
+        size_t pages = (size + page - 1) / page;
+        threads = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+        threads = (int)std::max<size_t>(1, std::min<size_t>(threads, pages / 256 + 1));   // Not worth a thread below ~1 MiB each
+
+        auto touch = [data, size, page](size_t first_page, size_t last_page) {
+            for(size_t p = first_page; p < last_page; p++)
+            {
+                *(volatile unsigned char*)(data + std::min(p * page, size - 1)) = 0;
+            }
+        };
+
+        if(threads == 1)
+        {
+            touch(0, pages);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        size_t pages_per_thread = pages / threads;
+
+        for(int i = 0; i < threads; i++)
+        {
+            size_t first_page = pages_per_thread * i;
+            size_t last_page = i < threads - 1 ? first_page + pages_per_thread : pages;
+            workers.push_back(std::thread(touch, first_page, last_page));
+        }
+
+        for(std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Allocate size bytes (at least 64-byte aligned) following the options
+    inline Allocation allocate(size_t size, const AllocOptions &options, size_t alignment = 64)
+    {
+        Allocation allocation;
+        allocation.size = size;
+
+#if defined(AF_HAS_MMAN)
+        if(options.policy != AllocPolicy::Malloc && size > 0)
+        {
+            size_t rounded = ((size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+
+#if defined(MAP_HUGETLB)
+            if(options.policy == AllocPolicy::HugeTlb)
+            {
+                void* mapping = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+                if(mapping != MAP_FAILED)
+                {
+                    allocation.data = (unsigned char*)mapping;
+                    allocation.mapping = mapping;
+                    allocation.mapping_size = rounded;
+                    allocation.huge = true;
+                }
+            }
+#endif
+
+            if(allocation.data == nullptr)
+            {
+                // Over-allocate by one huge page and cut off the unaligned head and tail, so the whole buffer can be backed by huge pages
+                size_t reserved = rounded + HUGE_PAGE_SIZE;
+                void* mapping = mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+                if(mapping != MAP_FAILED)
+                {
+                    uintptr_t start = (uintptr_t)mapping;
+                    uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+                    size_t head = aligned - start;
+                    size_t tail = reserved - head - rounded;
+
+                    if(head > 0)
+                    {
+                        munmap(mapping, head);
+                    }
+
+                    if(tail > 0)
+                    {
+                        munmap((void*)(aligned + rounded), tail);
+                    }
+
+                    allocation.data = (unsigned char*)aligned;
+                    allocation.mapping = (void*)aligned;
+                    allocation.mapping_size = rounded;
+#if defined(MADV_HUGEPAGE)
+                    allocation.huge = madvise(allocation.mapping, rounded, MADV_HUGEPAGE) == 0;
+#endif
+                }
+            }
+        }
+#endif
+
+        if(allocation.data == nullptr)
+        {
+            size_t rounded = std::max(alignment, ((size + alignment - 1) / alignment) * alignment);
+            allocation.data = (unsigned char*)aligned_alloc(alignment, rounded);
+        }
+
+        if(allocation.data == nullptr)
+        {
+            return allocation;
+        }
+
+        if(options.prefault)
+        {
+            prefault(allocation.data, std::max<size_t>(size, 1), options.prefault_threads);
+        }
+
+#if defined(AF_HAS_MMAN)
+        if(options.lock)
+        {
+            allocation.locked = mlock(allocation.data, size) == 0;
+        }
+#endif
+
+        return allocation;
+    }
+
+    // Give an allocation back and reset it
+    inline void deallocate(Allocation &allocation)
+    {
+        if(allocation.data == nullptr)
+        {
+            return;
+        }
+
+#if defined(AF_HAS_MMAN)
+        if(allocation.locked)
+        {
+            munlock(allocation.data, allocation.size);
+        }
+
+        if(allocation.mapping != nullptr)
+        {
+            munmap(allocation.mapping, allocation.mapping_size);
+        }
+        else
+        {
+            free(allocation.data);
+        }
+#else
+        free(allocation.data);
+#endif
+
+        allocation = Allocation();
+    }
+};
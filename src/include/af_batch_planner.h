@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <thread>
+#include <algorithm>
+
+#include "af_parallel.h"
+#include "af_buffer_pool.h"
+#include "af_probe.h"
+
+
+namespace af
+{
+    // One image of a batch
+    struct BatchJob
+    {
+        std::string path;
+        ImageInfo info;
+        size_t bytes = 0;   // Decoded size (ImageInfo::decodedSize)
+    };
+
+    // Probed batch, jobs ordered largest first so the big images start early and the small ones fill the gaps at the end
+    struct BatchPlan
+    {
+        std::vector<BatchJob> jobs;
+        std::vector<std::string> failed;    // Missing or unreadable files
+        size_t total_bytes = 0;             // All decoded images
+        size_t peak_bytes = 0;              // Worst case with the planned number of images in flight: the largest ones at once
+        int concurrency = 1;
+    };
+
+    // Probe all files (headers only, spread over thread_count threads, by default 4 per core up to 64) and order them largest first.
+    // concurrency is the number of images that will be decoded at the same time (by default one per core), which the peak estimate and
+    // reserveBuffers() use.
+    inline BatchPlan planBatch(const std::vector<std::string> &paths, int concurrency = 0, int thread_count = 0)
+    {
+        BatchPlan plan;
+        std::vector<ImageInfo> infos(paths.size());
+        int cores = std::max(1, (int)std::thread::hardware_concurrency());
+        plan.concurrency = concurrency > 0 ? concurrency : cores;
+
+        // Probing is I/O bound, more threads than cores keep more reads in flight on cold caches
+        thread_count = thread_count > 0 ? thread_count : std::min(cores * 4, 64);
+        thread_count = std::max(1, std::min(thread_count, (int)paths.size()));
+
+        parallelRows(0, (int)paths.size(), thread_count, [&](int, int start, int end) {
+            for(int i = start; i < end; i++)
+            {
+                infos.at(i) = probeFile(paths.at(i).c_str());
+            }
+        });
+
+        for(size_t i = 0; i < paths.size(); i++)
+        {
+            if(!infos.at(i).valid)
+            {
+                plan.failed.push_back(paths.at(i));
+                continue;
+            }
+
+            BatchJob job;
+            job.path = paths.at(i);
+            job.info = infos.at(i);
+            job.bytes = job.info.decodedSize();
+            plan.total_bytes += job.bytes;
+            plan.jobs.push_back(job);
+        }
+
+        std::stable_sort(plan.jobs.begin(), plan.jobs.end(), [](const BatchJob &a, const BatchJob &b) {
+            return a.bytes > b.bytes;
+        });
+
+        for(int i = 0; i < (int)plan.jobs.size() && i < plan.concurrency; i++)
+        {
+            plan.peak_bytes += plan.jobs.at(i).bytes;
+        }
+
+        return plan;
+    }
+
+    // Pre-size a pool for a plan: per buffer size, as many buffers as can be in flight at once (at most plan.concurrency).
+    // Images that allocate from the pool (Image::setPool) then decode into memory that is already faulted in.
+    inline void reserveBuffers(const BatchPlan &plan, BufferPool &pool)
+    {
+        std::map<size_t, int> counts;  // Bucket size -> images
+
+        for(const BatchJob &job : plan.jobs)
+        {
+            counts[BufferPool::bucketSize(job.bytes)]++;
+        }
+
+        for(const auto &count : counts)
+        {
+            pool.reserve(count.first, std::min(count.second, plan.concurrency));
+        }
+    }
+};
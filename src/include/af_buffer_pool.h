@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+
+namespace af
+{
+    // Counters of a BufferPool
+    struct BufferPoolStats
+    {
+        uint64_t acquires = 0;      // Buffers handed out
+        uint64_t reuses = 0;        // ... of which came from the free lists
+        uint64_t releases = 0;      // Buffers given back
+        uint64_t evictions = 0;     // Released buffers freed because the pool was full
+        size_t bytes_held = 0;      // Bytes sitting idle in the free lists
+        size_t bytes_in_use = 0;    // Bytes currently handed out
+
+        // Share of the acquires served without a new allocation
+        double reuseRate() const
+        {
+            return acquires == 0 ? 0.0 : (double)reuses / acquires;
+        }
+    };
+
+
+    // Size-bucketed free lists of aligned buffers, so intermediate images of the same dimensions recycle memory whose pages are already faulted in
+    class BufferPool
+    {
+    private:
+        std::mutex m_mutex;
+        std::unordered_map<size_t, std::vector<unsigned char*>> m_free;     // Bucket size -> idle buffers
+        size_t m_max_bytes_held;
+        size_t m_alignment;
+        BufferPoolStats m_stats;
+
+    public:
+        static const size_t BUCKET_GRANULARITY = 4096;  // Sizes are rounded up to whole pages, so slightly different requests share a bucket
+
+        BufferPool(size_t max_bytes_held = (size_t)1 << 30, size_t alignment = 64)
+        {
+            m_max_bytes_held = max_bytes_held;
+            m_alignment = alignment;
+        }
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        ~BufferPool()
+        {
+            trim();
+        }
+
+        // Get the size of the bucket a request falls into
+        static size_t bucketSize(size_t size)
+        {
+            return ((size + BUCKET_GRANULARITY - 1) / BUCKET_GRANULARITY) * BUCKET_GRANULARITY;
+        }
+
+        // Get a buffer of at least size bytes, recycled if possible, give it back with release() and the same size. nullptr if the allocation fails.
+        unsigned char* acquire(size_t size)
+        {
+            size_t bucket = bucketSize(size);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto found = m_free.find(bucket);
+            unsigned char* buffer;
+
+            if(found != m_free.end() && !found->second.empty())
+            {
+                buffer = found->second.back();
+                found->second.pop_back();
+                m_stats.reuses++;
+                m_stats.bytes_held -= bucket;
+            }
+            else
+            {
+                buffer = (unsigned char*)aligned_alloc(m_alignment, bucket);
+
+                if(buffer == nullptr)
+                {
+                    return nullptr;     // Out of memory, nothing was handed out
+                }
+            }
+
+            m_stats.acquires++;
+            m_stats.bytes_in_use += bucket;
+            return buffer;
+        }
+
+        // Give a buffer back, it is kept for the next acquire() of the same bucket unless the pool already holds max_bytes_held
+        void release(unsigned char* buffer, size_t size)
+        {
+            if(buffer == nullptr)
+            {
+                return;
+            }
+
+            size_t bucket = bucketSize(size);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.releases++;
+            m_stats.bytes_in_use -= bucket;
+
+            if(m_stats.bytes_held + bucket > m_max_bytes_held)
+            {
+                m_stats.evictions++;
+                free(buffer);
+                return;
+            }
+
+            m_free[bucket].push_back(buffer);
+            m_stats.bytes_held += bucket;
+        }
+
+        // Free all idle buffers
+        void trim()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            for(auto &bucket : m_free)
+            {
+                for(unsigned char* buffer : bucket.second)
+                {
+                    free(buffer);
+                }
+            }
+
+            m_free.clear();
+            m_stats.bytes_held = 0;
+        }
+
+        // Make sure count idle buffers of the given size are available, e.g. before a batch of images with known dimensions
+        void reserve(size_t size, int count)
+        {
+            size_t bucket = bucketSize(size);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::vector<unsigned char*> &buffers = m_free[bucket];
+
+            while((int)buffers.size() < count && m_stats.bytes_held + bucket <= m_max_bytes_held)
+            {
+                unsigned char* buffer = (unsigned char*)aligned_alloc(m_alignment, bucket);
+
+                if(buffer == nullptr)
+                {
+                    return;
+                }
+
+                memset(buffer, 0, bucket);  // Fault the pages in now instead of during the first pass over the image
+                buffers.push_back(buffer);
+                m_stats.bytes_held += bucket;
+            }
+        }
+
+        // Get a snapshot of the counters
+        BufferPoolStats getStats()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_stats;
+        }
+
+        // Process-wide pool
+        static BufferPool& global()
+        {
+            static BufferPool pool;
+            return pool;
+        }
+    };
+};
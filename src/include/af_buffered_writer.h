@@ -0,0 +1,240 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define AF_HAS_FD_WRITER 1
+#endif
+
+#include "af_afraw.h"
+
+
+namespace af
+{
+    // Large buffered output for the stbi_write_*_to_func encoders: the encoders emit many tiny writes (single bytes for the JPEG
+    // entropy coder), this collects them into buffer_size blocks which go out in one write() each. Targets are a file descriptor
+    // (a file, a pipe or stdout) or an in-memory vector. With a background flush thread, one block is written while the encoder
+    // fills the next one.
+    class BufferedWriter
+    {
+    private:
+        std::vector<unsigned char>* m_memory = nullptr;
+        int m_fd = -1;
+        bool m_owns_fd = false;
+        std::atomic<bool> m_failed{false};   // Also set by the flush thread
+        size_t m_written = 0;
+
+        std::vector<unsigned char> m_buffer;        // Filled by the encoder
+        std::vector<unsigned char> m_flushing;      // Written by the flush thread
+        size_t m_buffer_size = 0;
+
+        bool m_background = false;
+        bool m_pending = false;                     // m_flushing holds a block that is not written yet
+        bool m_stop = false;
+        bool m_closed = false;                      // After close() everything is written synchronously (and fails for a closed descriptor)
+        std::thread m_thread;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+
+        // Hand a block to the target (called by the flush thread or, without one, by the encoder thread)
+        bool output(const unsigned char* data, size_t size)
+        {
+            if(m_memory != nullptr)
+            {
+                m_memory->insert(m_memory->end(), data, data + size);
+                return true;
+            }
+
+#if defined(AF_HAS_FD_WRITER)
+            return writeAll(m_fd, data, size);
+#else
+            return false;
+#endif
+        }
+
+        void flushLoop()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while(true)
+            {
+                m_cond.wait(lock, [&]() { return m_pending || m_stop; });
+
+                if(!m_pending)
+                {
+                    return;
+                }
+
+                lock.unlock();
+                bool ok = output(m_flushing.data(), m_flushing.size());
+                lock.lock();
+
+                m_failed = m_failed || !ok;
+                m_flushing.clear();
+                m_pending = false;
+                m_cond.notify_all();
+            }
+        }
+
+        void start(size_t buffer_size, bool background)
+        {
+            m_buffer_size = buffer_size > 0 ? buffer_size : 1;
+            m_buffer.reserve(m_buffer_size);
+            m_background = background;
+
+            if(m_background)
+            {
+                m_flushing.reserve(m_buffer_size);
+                m_thread = std::thread(&BufferedWriter::flushLoop, this);
+            }
+        }
+
+    public:
+        static const size_t DEFAULT_BUFFER_SIZE = (size_t)1 << 20;
+
+        // Write into a vector (appended to)
+        explicit BufferedWriter(std::vector<unsigned char>* memory, size_t buffer_size = DEFAULT_BUFFER_SIZE, bool background = false)
+        {
+            m_memory = memory;
+            m_failed = memory == nullptr;
+            start(buffer_size, background);
+        }
+
+        // Write to an open file descriptor (a file, a pipe, STDOUT_FILENO...), which is closed by close() if owns_fd is set
+        explicit BufferedWriter(int fd, bool owns_fd = false, size_t buffer_size = DEFAULT_BUFFER_SIZE, bool background = false)
+        {
+            m_fd = fd;
+            m_owns_fd = owns_fd;
+            m_failed = fd < 0;
+            start(buffer_size, background);
+        }
+
+        // Create (or truncate) a file and write to it
+        explicit BufferedWriter(const char* path, size_t buffer_size = DEFAULT_BUFFER_SIZE, bool background = true)
+        {
+#if defined(AF_HAS_FD_WRITER)
+            m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+            m_owns_fd = true;
+            m_failed = m_fd < 0;
+            start(buffer_size, background);
+        }
+
+        BufferedWriter(const BufferedWriter&) = delete;
+        BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+        ~BufferedWriter()
+        {
+            close();
+        }
+
+        // Append bytes, a full buffer is flushed (or handed to the flush thread)
+        void write(const unsigned char* data, size_t size)
+        {
+            m_written += size;
+
+            // Fast path for the single bytes of the JPEG entropy coder
+            if(size == 1 && m_buffer.size() + 1 < m_buffer_size)
+            {
+                m_buffer.push_back(*data);
+                return;
+            }
+
+            while(size > 0)
+            {
+                size_t chunk = std::min(size, m_buffer_size - m_buffer.size());
+                m_buffer.insert(m_buffer.end(), data, data + chunk);
+                data += chunk;
+                size -= chunk;
+
+                if(m_buffer.size() == m_buffer_size)
+                {
+                    flush();
+                }
+            }
+        }
+
+        // Push out the buffered bytes (asynchronously with a flush thread)
+        void flush()
+        {
+            if(m_buffer.empty())
+            {
+                return;
+            }
+
+            if(!m_background || m_closed)
+            {
+                m_failed = !output(m_buffer.data(), m_buffer.size()) || m_failed;
+                m_buffer.clear();
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&]() { return !m_pending; });
+            m_buffer.swap(m_flushing);
+            m_buffer.reserve(m_buffer_size);
+            m_pending = true;
+            m_cond.notify_all();
+        }
+
+        // Flush everything, stop the flush thread and close an owned descriptor, returns false if any write failed
+        bool close()
+        {
+            if(m_closed)
+            {
+                flush();
+                return !m_failed;
+            }
+
+            flush();
+            m_closed = true;
+
+            if(m_thread.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_stop = true;
+                }
+
+                m_cond.notify_all();
+                m_thread.join();
+            }
+
+#if defined(AF_HAS_FD_WRITER)
+            if(m_owns_fd && m_fd >= 0)
+            {
+                m_failed = (::close(m_fd) != 0) || m_failed;
+                m_fd = -1;
+            }
+#endif
+
+            return !m_failed;
+        }
+
+        // Bytes passed to write() so far
+        size_t getWritten()
+        {
+            return m_written;
+        }
+
+        bool failed()
+        {
+            return m_failed;
+        }
+
+        // stbi_write_func, context is the BufferedWriter
+        static void callback(void* context, void* data, int size)
+        {
+            ((BufferedWriter*)context)->write((const unsigned char*)data, (size_t)size);
+        }
+    };
+};
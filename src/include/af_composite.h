@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+namespace af
+{
+    // Porter-Duff / separable blend modes, all of them work on premultiplied RGBA
+    enum class BlendMode
+    {
+        Over,
+        Multiply,
+        Screen
+    };
+
+    // Exact rounded x / 255 for x in [0, 65535] without a division
+    inline uint32_t div255(uint32_t x)
+    {
+        x += 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+#if defined(__SSE2__)
+    // Same as div255 on eight 16-bit lanes
+    inline __m128i div255Epi16(__m128i x)
+    {
+        x = _mm_add_epi16(x, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    }
+
+    // Broadcast the alpha lane (3 and 7) of two unpacked RGBA pixels to all four lanes of its pixel
+    inline __m128i alphaEpi16(__m128i pixels)
+    {
+        pixels = _mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+        return _mm_shufflehi_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+
+    // Blend two unpacked premultiplied RGBA pixels (16-bit lanes)
+    inline __m128i blendEpi16(BlendMode mode, __m128i dst, __m128i src)
+    {
+        const __m128i full = _mm_set1_epi16(255);
+        __m128i inv_src_alpha = _mm_sub_epi16(full, alphaEpi16(src));
+
+        switch(mode)
+        {
+            case BlendMode::Multiply:
+            {
+                // S * (255 - Da) + S * D + D * (255 - Sa), every product fits into 16 bits and the saturating adds give min(65535, sum)
+                // like the scalar path. Colour above alpha can push the sum past 255 * 255, clamped there it still divides to 255 (what
+                // the scalar path clamps to) and div255Epi16 does not overflow.
+                const __m128i limit = _mm_set1_epi16((short)(255 * 255));
+                __m128i inv_dst_alpha = _mm_sub_epi16(full, alphaEpi16(dst));
+                __m128i sum = _mm_adds_epu16(_mm_adds_epu16(_mm_mullo_epi16(src, inv_dst_alpha), _mm_mullo_epi16(src, dst)), _mm_mullo_epi16(dst, inv_src_alpha));
+                sum = _mm_sub_epi16(sum, _mm_subs_epu16(sum, limit));
+                return div255Epi16(sum);
+            }
+            case BlendMode::Screen:
+                return _mm_sub_epi16(_mm_add_epi16(src, dst), div255Epi16(_mm_mullo_epi16(src, dst)));
+            case BlendMode::Over:
+            default:
+                return _mm_add_epi16(src, div255Epi16(_mm_mullo_epi16(dst, inv_src_alpha)));
+        }
+    }
+#endif
+
+    // Blend a single premultiplied RGBA pixel
+    inline void blendPixel(BlendMode mode, unsigned char* dst, const unsigned char* src)
+    {
+        uint32_t src_alpha = *(src + 3);
+        uint32_t dst_alpha = *(dst + 3);
+
+        for(int c = 0; c < 4; c++)
+        {
+            uint32_t s = *(src + c);
+            uint32_t d = *(dst + c);
+            uint32_t result;
+
+            switch(mode)
+            {
+                case BlendMode::Multiply:
+                    result = div255(std::min(65535U, s * (255 - dst_alpha + d) + d * (255 - src_alpha)));
+                    break;
+                case BlendMode::Screen:
+                    result = s + d - div255(s * d);
+                    break;
+                case BlendMode::Over:
+                default:
+                    result = s + div255(d * (255 - src_alpha));
+                    break;
+            }
+
+            *(dst + c) = (uint8_t)std::min(255U, result);
+        }
+    }
+
+    // Blend a row of premultiplied RGBA pixels from src onto dst
+    inline void blendRow(BlendMode mode, unsigned char* dst, const unsigned char* src, int pixels)
+    {
+        int i = 0;
+
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+
+        for(; i + 4 <= pixels; i += 4)
+        {
+            __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+            __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+            __m128i lo = blendEpi16(mode, _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero));
+            __m128i hi = blendEpi16(mode, _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero));
+            _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+        }
+#endif
+
+        for(; i < pixels; i++)
+        {
+            blendPixel(mode, dst + i * 4, src + i * 4);
+        }
+    }
+
+    // dst = src * mask + dst * (1 - mask), mask has one byte per pixel, works for any channel count
+    inline void maskBlendRow(unsigned char* dst, const unsigned char* src, const unsigned char* mask, int pixels, int channels)
+    {
+        int i = 0;
+
+#if defined(__SSE2__)
+        if(channels == 4)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i full = _mm_set1_epi16(255);
+
+            for(; i + 4 <= pixels; i += 4)
+            {
+                // Spread the four mask bytes over the four channels of their pixel
+                int32_t bytes;
+                memcpy(&bytes, mask + i, 4);
+                __m128i m = _mm_cvtsi32_si128(bytes);
+                m = _mm_unpacklo_epi8(m, m);
+                m = _mm_unpacklo_epi16(m, m);
+                __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+                __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+                __m128i m_lo = _mm_unpacklo_epi8(m, zero);
+                __m128i m_hi = _mm_unpackhi_epi8(m, zero);
+                __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), m_lo), _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, m_lo)));
+                __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), m_hi), _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, m_hi)));
+                _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(div255Epi16(lo), div255Epi16(hi)));
+            }
+        }
+#endif
+
+        for(; i < pixels; i++)
+        {
+            uint32_t m = *(mask + i);
+
+            for(int c = 0; c < channels; c++)
+            {
+                *(dst + i * channels + c) = (uint8_t)div255(*(src + i * channels + c) * m + *(dst + i * channels + c) * (255 - m));
+            }
+        }
+    }
+
+    // Multiply the colour channels of a row of RGBA pixels by their alpha
+    inline void premultiplyRow(unsigned char* row, int pixels)
+    {
+        int i = 0;
+
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i alpha_mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+        for(; i + 4 <= pixels; i += 4)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i*)(row + i * 4));
+            __m128i lo = _mm_unpacklo_epi8(p, zero);
+            __m128i hi = _mm_unpackhi_epi8(p, zero);
+            // Keep the alpha lanes by multiplying them with 255 instead of themselves
+            __m128i alpha_lo = _mm_or_si128(_mm_andnot_si128(alpha_mask, alphaEpi16(lo)), _mm_and_si128(alpha_mask, _mm_set1_epi16(255)));
+            __m128i alpha_hi = _mm_or_si128(_mm_andnot_si128(alpha_mask, alphaEpi16(hi)), _mm_and_si128(alpha_mask, _mm_set1_epi16(255)));
+            lo = div255Epi16(_mm_mullo_epi16(lo, alpha_lo));
+            hi = div255Epi16(_mm_mullo_epi16(hi, alpha_hi));
+            _mm_storeu_si128((__m128i*)(row + i * 4), _mm_packus_epi16(lo, hi));
+        }
+#endif
+
+        for(; i < pixels; i++)
+        {
+            uint32_t alpha = *(row + i * 4 + 3);
+            *(row + i * 4) = (uint8_t)div255(*(row + i * 4) * alpha);
+            *(row + i * 4 + 1) = (uint8_t)div255(*(row + i * 4 + 1) * alpha);
+            *(row + i * 4 + 2) = (uint8_t)div255(*(row + i * 4 + 2) * alpha);
+        }
+    }
+
+    // Divide the colour channels of a row of premultiplied RGBA pixels by their alpha
+    inline void unpremultiplyRow(unsigned char* row, int pixels)
+    {
+        for(int i = 0; i < pixels; i++)
+        {
+            uint32_t alpha = *(row + i * 4 + 3);
+
+            if(alpha == 0)
+            {
+                continue;
+            }
+
+            for(int c = 0; c < 3; c++)
+            {
+                *(row + i * 4 + c) = (uint8_t)std::min(255U, (*(row + i * 4 + c) * 255 + alpha / 2) / alpha);
+            }
+        }
+    }
+};
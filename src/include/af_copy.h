@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <thread>
+
+#if defined(__unix__)
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <tmmintrin.h>
+#define AF_HAS_SSSE3_DISPATCH 1     // SSSE3 kernels are compiled with a target attribute and picked at runtime
+#endif
+
+#include "af_image_view.h"
+#include "af_parallel.h"
+
+
+namespace af
+{
+    // Channel reordering copies
+    enum class ChannelConversion
+    {
+        RgbToBgr,   // Also BGR -> RGB
+        RgbToRgba,  // Alpha is set to 255
+        RgbaToRgb,  // Alpha is dropped
+        RgbaToBgra  // Also BGRA -> RGBA
+    };
+
+    // Get the size of the last level cache (in bytes), copies larger than this bypass the cache
+    inline size_t lastLevelCacheSize()
+    {
+        static size_t size = []() {
+            long cache = 0;
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+            cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+            if(cache <= 0)
+            {
+                cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+            }
+#endif
+            return cache > 0 ? (size_t)cache : (size_t)8 << 20;
+        }();
+
+        return size;
+    }
+
+    // memcpy with non-temporal stores, the destination does not displace the working set from the cache
+    inline void streamCopy(unsigned char* dst, const unsigned char* src, size_t size)
+    {
+#if defined(__SSE2__)
+        size_t head = std::min(size, (size_t)((16 - ((uintptr_t)dst & 15)) & 15));
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        size -= head;
+
+        for(; size >= 64; size -= 64, dst += 64, src += 64)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+            _mm_stream_si128((__m128i*)dst, a);
+            _mm_stream_si128((__m128i*)(dst + 16), b);
+            _mm_stream_si128((__m128i*)(dst + 32), c);
+            _mm_stream_si128((__m128i*)(dst + 48), d);
+        }
+
+        _mm_sfence();
+#endif
+        memcpy(dst, src, size);
+    }
+
+    // Copy a view into another one with the same dimensions and channel count: one memcpy for contiguous buffers, row by row otherwise.
+    // Copies larger than the last level cache are split over thread_count threads and use non-temporal stores.
+    inline void copyView(const ConstImageView &src, const ImageView &dst, int thread_count = 0)
+    {
+        if(!src.valid() || !dst.valid() || src.width != dst.width || src.height != dst.height || src.channels != dst.channels)
+        {
+            return; // TODO: Error-handling
+        }
+
+        size_t row_bytes = (size_t)src.width * src.channels;
+        size_t total = row_bytes * src.height;
+        bool large = total > lastLevelCacheSize();
+        bool contiguous = src.contiguous() && dst.contiguous();
+        thread_count = large ? (thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency()) : 1;
+
+        if(contiguous && thread_count <= 1)
+        {
+            large ? streamCopy(dst.data, src.data, total) : (void)memcpy(dst.data, src.data, total);
+            return;
+        }
+
+        parallelRows(0, src.height, thread_count, [&](int, int start_row, int end_row) {
+            if(contiguous)
+            {
+                streamCopy(dst.row(start_row), src.row(start_row), row_bytes * (end_row - start_row));
+                return;
+            }
+
+            for(int row = start_row; row < end_row; row++)
+            {
+                large ? streamCopy(dst.row(row), src.row(row), row_bytes) : (void)memcpy(dst.row(row), src.row(row), row_bytes);
+            }
+        });
+    }
+
+    // Scalar channel conversion of one row, dst may equal src except for RgbToRgba
+    inline void convertRowScalar(ChannelConversion conversion, unsigned char* dst, const unsigned char* src, int pixels)
+    {
+        int i;
+
+        switch(conversion)
+        {
+            case ChannelConversion::RgbToBgr:
+                for(i = 0; i < pixels; i++)
+                {
+                    unsigned char r = *(src + i * 3);
+                    *(dst + i * 3 + 1) = *(src + i * 3 + 1);
+                    *(dst + i * 3) = *(src + i * 3 + 2);
+                    *(dst + i * 3 + 2) = r;
+                }
+                break;
+            case ChannelConversion::RgbToRgba:
+                for(i = 0; i < pixels; i++)
+                {
+                    *(dst + i * 4) = *(src + i * 3);
+                    *(dst + i * 4 + 1) = *(src + i * 3 + 1);
+                    *(dst + i * 4 + 2) = *(src + i * 3 + 2);
+                    *(dst + i * 4 + 3) = 255;
+                }
+                break;
+            case ChannelConversion::RgbaToRgb:
+                for(i = 0; i < pixels; i++)
+                {
+                    *(dst + i * 3) = *(src + i * 4);
+                    *(dst + i * 3 + 1) = *(src + i * 4 + 1);
+                    *(dst + i * 3 + 2) = *(src + i * 4 + 2);
+                }
+                break;
+            case ChannelConversion::RgbaToBgra:
+                for(i = 0; i < pixels; i++)
+                {
+                    unsigned char r = *(src + i * 4);
+                    *(dst + i * 4 + 1) = *(src + i * 4 + 1);
+                    *(dst + i * 4 + 3) = *(src + i * 4 + 3);
+                    *(dst + i * 4) = *(src + i * 4 + 2);
+                    *(dst + i * 4 + 2) = r;
+                }
+                break;
+        }
+    }
+
+#if defined(AF_HAS_SSSE3_DISPATCH)
+    // pshufb version, returns the number of pixels done, the caller finishes the rest with convertRowScalar.
+    // Every step loads and stores 16 bytes, the loop stops early enough to never touch bytes past the row.
+    __attribute__((target("ssse3")))
+    inline int convertRowSsse3(ChannelConversion conversion, unsigned char* dst, const unsigned char* src, int pixels)
+    {
+        int i = 0;
+
+        switch(conversion)
+        {
+            case ChannelConversion::RgbToBgr:
+            {
+                // Five pixels per step, byte 15 keeps its value so working in place is safe
+                const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+
+                for(; i + 6 <= pixels; i += 5)
+                {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 3));
+                    _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(v, mask));
+                }
+                break;
+            }
+            case ChannelConversion::RgbToRgba:
+            {
+                const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+                const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+
+                for(; i + 6 <= pixels; i += 4)
+                {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 3));
+                    _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, mask), alpha));
+                }
+                break;
+            }
+            case ChannelConversion::RgbaToRgb:
+            {
+                const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+                for(; i + 6 <= pixels; i += 4)
+                {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+                    _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(v, mask));
+                }
+                break;
+            }
+            case ChannelConversion::RgbaToBgra:
+            {
+                const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+                for(; i + 4 <= pixels; i += 4)
+                {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+                    _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(v, mask));
+                }
+                break;
+            }
+        }
+
+        return i;
+    }
+#endif
+
+    // Convert the channel layout of one row
+    inline void convertRow(ChannelConversion conversion, unsigned char* dst, const unsigned char* src, int pixels)
+    {
+        int done = 0;
+        int src_channels = (conversion == ChannelConversion::RgbToBgr || conversion == ChannelConversion::RgbToRgba) ? 3 : 4;
+        int dst_channels = (conversion == ChannelConversion::RgbToBgr || conversion == ChannelConversion::RgbaToRgb) ? 3 : 4;
+
+#if defined(AF_HAS_SSSE3_DISPATCH)
+        static bool has_ssse3 = __builtin_cpu_supports("ssse3");
+
+        if(has_ssse3)
+        {
+            done = convertRowSsse3(conversion, dst, src, pixels);
+        }
+#endif
+
+        convertRowScalar(conversion, dst + done * dst_channels, src + done * src_channels, pixels - done);
+    }
+
+    // Convert the channel layout of a whole view into another one with the same dimensions, row-parallel
+    inline void convertView(ChannelConversion conversion, const ConstImageView &src, const ImageView &dst, int thread_count = 0)
+    {
+        int src_channels = (conversion == ChannelConversion::RgbToBgr || conversion == ChannelConversion::RgbToRgba) ? 3 : 4;
+        int dst_channels = (conversion == ChannelConversion::RgbToBgr || conversion == ChannelConversion::RgbaToRgb) ? 3 : 4;
+
+        if(!src.valid() || !dst.valid() || src.width != dst.width || src.height != dst.height ||
+           src.channels != src_channels || dst.channels != dst_channels)
+        {
+            return; // TODO: Error-handling
+        }
+
+        thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+
+        parallelRows(0, src.height, thread_count, [&](int, int start_row, int end_row) {
+            for(int row = start_row; row < end_row; row++)
+            {
+                convertRow(conversion, dst.row(row), src.row(row), src.width);
+            }
+        });
+    }
+};
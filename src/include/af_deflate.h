@@ -0,0 +1,471 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include "af_parallel.h"
+
+
+namespace af
+{
+    const uint32_t ADLER_BASE = 65521;
+    const int DEFLATE_WINDOW = 32768;
+    const size_t DEFLATE_MIN_STRIP = (size_t)128 << 10;    // Smaller strips lose too much to the restarted Huffman blocks
+
+    // Adler-32 of data, continuing from adler
+    inline uint32_t adler32(const unsigned char* data, size_t size, uint32_t adler = 1)
+    {
+        uint32_t s1 = adler & 0xFFFF;
+        uint32_t s2 = adler >> 16;
+
+        while(size > 0)
+        {
+            size_t block = std::min(size, (size_t)5552);    // Largest block without overflowing s2
+            size -= block;
+
+            for(; block > 0; block--)
+            {
+                s1 += *data++;
+                s2 += s1;
+            }
+
+            s1 %= ADLER_BASE;
+            s2 %= ADLER_BASE;
+        }
+
+        return (s2 << 16) | s1;
+    }
+
+    // Adler-32 of the concatenation of two buffers from their Adler-32s and the size of the second one (zlib's adler32_combine)
+    inline uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2)
+    {
+        uint32_t rem = (uint32_t)(size2 % ADLER_BASE);
+        uint32_t sum1 = adler1 & 0xFFFF;
+        uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % ADLER_BASE);
+        sum1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+        sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+
+        if(sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+        if(sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+        if(sum2 >= (ADLER_BASE << 1)) sum2 -= (ADLER_BASE << 1);
+        if(sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+
+        return (sum2 << 16) | sum1;
+    }
+
+    // LSB-first bit output of deflate
+    struct DeflateBits
+    {
+        std::vector<unsigned char> &out;
+        uint64_t bits = 0;
+        int count = 0;
+
+        explicit DeflateBits(std::vector<unsigned char> &output) : out(output) {}
+
+        void add(uint32_t code, int length)
+        {
+            bits |= (uint64_t)code << count;
+            count += length;
+
+            while(count >= 8)
+            {
+                out.push_back((unsigned char)bits);
+                bits >>= 8;
+                count -= 8;
+            }
+        }
+
+        // Pad with 0 bits to a byte boundary
+        void align()
+        {
+            if(count > 0)
+            {
+                add(0, 8 - count);
+            }
+        }
+    };
+
+    // Fixed Huffman codes (bit-reversed, ready for DeflateBits) and the length/distance code tables of deflate
+    struct DeflateTables
+    {
+        uint16_t literal_code[288];
+        uint8_t literal_length[288];
+        uint16_t length_symbol[259];        // Match length -> symbol 257..285
+        uint8_t distance_symbol_low[513];   // Distance - 1 < 512 -> symbol
+        uint8_t distance_symbol_high[256];  // (Distance - 1) >> 7 -> symbol
+
+        static const DeflateTables &get()
+        {
+            static const DeflateTables tables;
+            return tables;
+        }
+
+        static int reverse(int code, int bits)
+        {
+            int result = 0;
+
+            while(bits--)
+            {
+                result = (result << 1) | (code & 1);
+                code >>= 1;
+            }
+
+            return result;
+        }
+
+        DeflateTables()
+        {
+            for(int n = 0; n < 288; n++)
+            {
+                int code, bits;
+
+                if(n <= 143) { code = 0x30 + n; bits = 8; }
+                else if(n <= 255) { code = 0x190 + n - 144; bits = 9; }
+                else if(n <= 279) { code = n - 256; bits = 7; }
+                else { code = 0xC0 + n - 280; bits = 8; }
+
+                literal_code[n] = (uint16_t)reverse(code, bits);
+                literal_length[n] = (uint8_t)bits;
+            }
+
+            for(int length = 3, symbol = 0; length <= 258; length++)
+            {
+                while(symbol < 28 && length >= LENGTH_BASE[symbol + 1])
+                {
+                    symbol++;
+                }
+
+                length_symbol[length] = (uint16_t)(257 + symbol);
+            }
+
+            for(int d = 0, symbol = 0; d < 513; d++)
+            {
+                while(symbol < 29 && d + 1 >= DISTANCE_BASE[symbol + 1])
+                {
+                    symbol++;
+                }
+
+                distance_symbol_low[d] = (uint8_t)symbol;
+            }
+
+            for(int d = 0, symbol = 0; d < 256; d++)
+            {
+                while(symbol < 29 && (d << 7) + 1 >= DISTANCE_BASE[symbol + 1])
+                {
+                    symbol++;
+                }
+
+                distance_symbol_high[d] = (uint8_t)symbol;
+            }
+        }
+
+        static constexpr uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static constexpr uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static constexpr uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                                       4097, 6145, 8193, 12289, 16385, 24577};
+        static constexpr uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+        void literal(DeflateBits &bits, int value) const
+        {
+            bits.add(literal_code[value], literal_length[value]);
+        }
+
+        void match(DeflateBits &bits, int length, int distance) const
+        {
+            int symbol = length_symbol[length];
+            literal(bits, symbol);
+            bits.add(length - LENGTH_BASE[symbol - 257], LENGTH_EXTRA[symbol - 257]);
+
+            int d = distance - 1;
+            int code = d < 512 ? distance_symbol_low[d] : distance_symbol_high[d >> 7];
+            bits.add(reverse(code, 5), 5);
+            bits.add(distance - DISTANCE_BASE[code], DISTANCE_EXTRA[code]);
+        }
+    };
+
+    // Match search effort per level 1..9. The chains are kept short like the hash buckets of the stb_image_write compressor (2 * level entries),
+    // so the default PNG level 8 costs about what it did with stb
+    struct DeflateLevel
+    {
+        int max_chain;      // Hash chain entries checked per position
+        int nice_length;    // Stop searching at this match length
+        bool lazy;          // Check the next position before taking a match, insert every matched position into the hash
+    };
+
+    inline DeflateLevel deflateLevel(int level)
+    {
+        static const DeflateLevel levels[10] = {
+            {0, 0, false}, {4, 8, false}, {6, 16, false}, {8, 32, false}, {8, 32, true},
+            {12, 64, true}, {16, 128, true}, {24, 128, true}, {32, 258, true}, {128, 258, true}
+        };
+
+        return levels[std::max(0, std::min(level, 9))];
+    }
+
+    // Deflate data[dictionary, dictionary + size) as a continuation of a stream: matches may reach back into the (up to 32 KiB) dictionary
+    // before it, which is what the previous strip ended with. A non-final strip ends with an empty stored block (a sync flush), so it is
+    // byte-aligned and can be followed by the next strip. Level 0 writes stored blocks.
+    inline void deflateStrip(const unsigned char* data, size_t dictionary, size_t size, bool final, int level, std::vector<unsigned char> &out)
+    {
+        DeflateBits bits(out);
+        const unsigned char* input = data + dictionary;
+
+        if(level <= 0)
+        {
+            size_t pos = 0;
+
+            do
+            {
+                size_t block = std::min(size - pos, (size_t)0xFFFF);
+                bool last = final && pos + block == size;
+                bits.add(last ? 1 : 0, 1);
+                bits.add(0, 2);
+                bits.align();
+                out.push_back((unsigned char)block);
+                out.push_back((unsigned char)(block >> 8));
+                out.push_back((unsigned char)~block);
+                out.push_back((unsigned char)(~block >> 8));
+                out.insert(out.end(), input + pos, input + pos + block);
+                pos += block;
+            } while(pos < size);
+
+            return;
+        }
+
+        const DeflateTables &tables = DeflateTables::get();
+        DeflateLevel effort = deflateLevel(level);
+        const int hash_bits = 15;
+        const size_t none = SIZE_MAX;     // Empty hash chain slot
+        std::vector<size_t> head((size_t)1 << hash_bits, none);
+        std::vector<size_t> prev(DEFLATE_WINDOW, none);
+        size_t end = dictionary + size;
+
+        auto hash = [&](size_t pos) {
+            return (((uint32_t)data[pos] << 10) ^ ((uint32_t)data[pos + 1] << 5) ^ data[pos + 2]) & (((uint32_t)1 << hash_bits) - 1);
+        };
+
+        auto insert = [&](size_t pos) {
+            if(pos + 2 < end)
+            {
+                uint32_t h = hash(pos);
+                prev[pos & (DEFLATE_WINDOW - 1)] = head[h];
+                head[h] = pos;
+            }
+        };
+
+        // Longest match for pos among the hash chain (only positions already inserted), returns its length (0 = none)
+        auto longestMatch = [&](size_t pos, int &distance) {
+            int limit = (int)std::min((size_t)258, end - pos);
+            int best = 0;
+
+            if(limit < 3)
+            {
+                return 0;
+            }
+
+            size_t candidate = head[hash(pos)];
+
+            for(int chain = effort.max_chain; candidate != none && chain > 0; chain--)
+            {
+                if(pos - candidate > (size_t)DEFLATE_WINDOW)
+                {
+                    break;
+                }
+
+                if(data[candidate + best] == data[pos + best])
+                {
+                    int length = 0;
+
+                    while(length + 8 <= limit)
+                    {
+                        uint64_t a, b;
+                        memcpy(&a, data + candidate + length, 8);
+                        memcpy(&b, data + pos + length, 8);
+
+                        if(a != b)
+                        {
+                            length += __builtin_ctzll(a ^ b) >> 3;
+                            break;
+                        }
+
+                        length += 8;
+                    }
+
+                    while(length < limit && length + 8 > limit && data[candidate + length] == data[pos + length])
+                    {
+                        length++;
+                    }
+
+                    if(length > best)
+                    {
+                        best = length;
+                        distance = (int)(pos - candidate);
+
+                        if(length >= effort.nice_length || length >= limit)
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                size_t next = prev[candidate & (DEFLATE_WINDOW - 1)];
+
+                if(next != none && next >= candidate)
+                {
+                    break;  // The ring slot was reused by a newer position
+                }
+
+                candidate = next;
+            }
+
+            return best >= 3 ? best : 0;
+        };
+
+        // Prime the hash chains with the dictionary
+        for(size_t pos = dictionary - std::min(dictionary, (size_t)DEFLATE_WINDOW); pos < dictionary; pos++)
+        {
+            insert(pos);
+        }
+
+        bits.add(final ? 1 : 0, 1);
+        bits.add(1, 2);     // Fixed Huffman codes
+
+        size_t pos = dictionary;
+
+        while(pos < end)
+        {
+            int distance = 0;
+            int length = longestMatch(pos, distance);
+
+            if(length > 0 && effort.lazy && length < effort.nice_length && pos + 1 < end)
+            {
+                insert(pos);
+                int next_distance = 0;
+
+                if(longestMatch(pos + 1, next_distance) > length)
+                {
+                    tables.literal(bits, data[pos]);
+                    pos++;
+                    continue;
+                }
+
+                tables.match(bits, length, distance);
+
+                for(int i = 1; i < length; i++)
+                {
+                    insert(pos + i);
+                }
+
+                pos += length;
+                continue;
+            }
+
+            insert(pos);
+
+            if(length > 0)
+            {
+                tables.match(bits, length, distance);
+
+                if(effort.lazy)
+                {
+                    for(int i = 1; i < length; i++)
+                    {
+                        insert(pos + i);
+                    }
+                }
+
+                pos += length;
+            }
+            else
+            {
+                tables.literal(bits, data[pos]);
+                pos++;
+            }
+        }
+
+        tables.literal(bits, 256);  // End of block
+
+        if(!final)
+        {
+            // Sync flush: empty stored block
+            bits.add(0, 3);
+            bits.align();
+            const unsigned char marker[] = {0, 0, 0xFF, 0xFF};
+            out.insert(out.end(), marker, marker + sizeof(marker));
+        }
+
+        bits.align();
+    }
+
+    // Compress into a zlib stream pigz-style: the input is cut into strips which are deflated on separate threads, every strip primed with the
+    // last 32 KiB of the one before it, then stitched together behind one zlib header with the combined Adler-32. Levels 0 (store) to 9.
+    inline std::vector<unsigned char> zlibCompressParallel(const unsigned char* data, size_t size, int level = 6, int thread_count = 0)
+    {
+        level = std::max(0, std::min(level, 9));
+        thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+
+        size_t strip_size = std::max(DEFLATE_MIN_STRIP, (size + thread_count - 1) / std::max(1, thread_count));
+        int strips = (int)std::max((size_t)1, (size + strip_size - 1) / strip_size);
+        std::vector<std::vector<unsigned char>> compressed(strips);
+        std::vector<uint32_t> adler(strips);
+
+        parallelRows(0, strips, thread_count, [&](int, int start_strip, int end_strip) {
+            for(int strip = start_strip; strip < end_strip; strip++)
+            {
+                size_t begin = (size_t)strip * strip_size;
+                size_t length = std::min(size - std::min(size, begin), strip_size);
+                size_t dictionary = std::min(begin, (size_t)DEFLATE_WINDOW);
+
+                compressed.at(strip).reserve(length / 2 + 64);
+                deflateStrip(data + begin - dictionary, dictionary, length, strip == strips - 1, level, compressed.at(strip));
+                adler.at(strip) = adler32(data + begin, length);
+            }
+        });
+
+        // Header: 32 KiB window, FLEVEL from the level, the check bits make it a multiple of 31
+        static const unsigned char flevel[10] = {0x01, 0x01, 0x5E, 0x5E, 0x5E, 0x5E, 0x9C, 0xDA, 0xDA, 0xDA};
+        std::vector<unsigned char> out = {0x78, flevel[level]};
+        uint32_t checksum = 1;
+
+        for(int strip = 0; strip < strips; strip++)
+        {
+            out.insert(out.end(), compressed.at(strip).begin(), compressed.at(strip).end());
+            size_t length = std::min(size - std::min(size, (size_t)strip * strip_size), strip_size);
+            checksum = strip == 0 ? adler.at(0) : adler32Combine(checksum, adler.at(strip), length);
+        }
+
+        out.push_back((unsigned char)(checksum >> 24));
+        out.push_back((unsigned char)(checksum >> 16));
+        out.push_back((unsigned char)(checksum >> 8));
+        out.push_back((unsigned char)checksum);
+        return out;
+    }
+
+    // Threads used by stbiwZlibCompress (0 = all cores)
+    inline int &deflateThreads()
+    {
+        static int threads = 0;
+        return threads;
+    }
+
+    // STBIW_ZLIB_COMPRESS replacement: stbi_write_png and friends compress through zlibCompressParallel, the level is
+    // stbi_write_png_compression_level (default 8). The result is malloc'ed, as stb_image_write frees it with STBIW_FREE.
+    inline unsigned char* stbiwZlibCompress(unsigned char* data, int data_len, int* out_len, int quality)
+    {
+        std::vector<unsigned char> zlib = zlibCompressParallel(data, (size_t)data_len, quality, deflateThreads());
+        unsigned char* out = (unsigned char*)malloc(zlib.size());
+
+        if(out == nullptr)
+        {
+            return nullptr;
+        }
+
+        memcpy(out, zlib.data(), zlib.size());
+        *out_len = (int)zlib.size();
+        return out;
+    }
+};
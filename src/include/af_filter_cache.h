@@ -0,0 +1,616 @@
+#pragma once
+
+#include <list>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#include "af_image_view.h"
+#include "af_parallel.h"
+#include "af_point_ops.h"
+#include "af_copy.h"
+#include "af_afraw.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+namespace af
+{
+    const uint64_t HASH_PRIME64_1 = 0x9E3779B185EBCA87ULL;  // The xxHash64 primes
+    const uint64_t HASH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t HASH_PRIME64_3 = 0x165667B19E3779F9ULL;
+    const uint64_t HASH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t HASH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+    const uint32_t HASH_PRIME32_1 = 0x9E3779B1U;
+
+    inline uint64_t rotateLeft64(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    // Final mix of xxHash64, every input bit affects every output bit
+    inline uint64_t hashAvalanche(uint64_t hash)
+    {
+        hash ^= hash >> 33;
+        hash *= HASH_PRIME64_2;
+        hash ^= hash >> 29;
+        hash *= HASH_PRIME64_3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    // Fast non-cryptographic 64-bit hash in the style of XXH3: 64-byte stripes go into 8 independent 64-bit lanes with one 32x32->64 bit
+    // multiply each, which SSE2 does two lanes at a time, and the lanes are scrambled every kilobyte. The scalar and SSE2 paths give the
+    // same result. Input is read in host byte order, the hash is meant for caches on the same machine, not for storage formats.
+    class ContentHash
+    {
+    private:
+        static const size_t STRIPE = 64;
+        static const int STRIPES_PER_SCRAMBLE = 16;
+
+        alignas(16) uint64_t m_acc[8];
+        alignas(16) uint64_t m_key[8];
+        unsigned char m_buffer[STRIPE];
+        size_t m_buffered = 0;
+        uint64_t m_length = 0;
+        int m_stripes = 0;      // Since the last scramble
+        uint64_t m_seed;
+
+        static uint64_t load64(const unsigned char* data)
+        {
+            uint64_t value;
+            memcpy(&value, data, 8);
+            return value;
+        }
+
+        void stripe(const unsigned char* data)
+        {
+#if defined(__SSE2__)
+            __m128i* acc = (__m128i*)m_acc;
+            const __m128i* key = (const __m128i*)m_key;
+
+            for(int i = 0; i < 4; i++)
+            {
+                __m128i value = _mm_loadu_si128((const __m128i*)(data + i * 16));
+                __m128i keyed = _mm_xor_si128(value, _mm_load_si128(key + i));
+                __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+                __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+                _mm_store_si128(acc + i, _mm_add_epi64(_mm_load_si128(acc + i), _mm_add_epi64(product, swapped)));
+            }
+#else
+            for(int i = 0; i < 8; i++)
+            {
+                uint64_t value = load64(data + i * 8);
+                uint64_t keyed = value ^ m_key[i];
+                m_acc[i ^ 1] += value;
+                m_acc[i] += (keyed & 0xFFFFFFFFULL) * (keyed >> 32);
+            }
+#endif
+            if(++m_stripes == STRIPES_PER_SCRAMBLE)
+            {
+                scramble();
+                m_stripes = 0;
+            }
+        }
+
+        // Fold the high bits back in, so they are not lost to the multiplies
+        void scramble()
+        {
+#if defined(__SSE2__)
+            __m128i* acc = (__m128i*)m_acc;
+            const __m128i* key = (const __m128i*)m_key;
+            const __m128i prime = _mm_set1_epi32((int)HASH_PRIME32_1);
+
+            for(int i = 0; i < 4; i++)
+            {
+                __m128i value = _mm_load_si128(acc + i);
+                value = _mm_xor_si128(_mm_xor_si128(value, _mm_srli_epi64(value, 47)), _mm_load_si128(key + i));
+                __m128i low = _mm_mul_epu32(value, prime);
+                __m128i high = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+                _mm_store_si128(acc + i, _mm_add_epi64(low, _mm_slli_epi64(high, 32)));
+            }
+#else
+            for(int i = 0; i < 8; i++)
+            {
+                uint64_t value = m_acc[i];
+                value = (value ^ (value >> 47)) ^ m_key[i];
+                m_acc[i] = value * HASH_PRIME32_1;
+            }
+#endif
+        }
+
+    public:
+        explicit ContentHash(uint64_t seed = 0)
+        {
+            m_seed = seed;
+
+            for(int i = 0; i < 8; i++)
+            {
+                m_key[i] = hashAvalanche(seed + HASH_PRIME64_5 * (uint64_t)(i + 1));
+            }
+
+            const uint64_t init[8] = {HASH_PRIME32_1, HASH_PRIME64_1, HASH_PRIME64_2, HASH_PRIME64_3,
+                                      HASH_PRIME64_4, HASH_PRIME64_5, HASH_PRIME32_1 ^ seed, HASH_PRIME64_1 ^ seed};
+            memcpy(m_acc, init, sizeof(m_acc));
+        }
+
+        void update(const void* data, size_t size)
+        {
+            const unsigned char* in = (const unsigned char*)data;
+            m_length += size;
+
+            if(m_buffered > 0)
+            {
+                size_t count = std::min(size, STRIPE - m_buffered);
+                memcpy(m_buffer + m_buffered, in, count);
+                m_buffered += count;
+                in += count;
+                size -= count;
+
+                if(m_buffered < STRIPE)
+                {
+                    return;
+                }
+
+                stripe(m_buffer);
+                m_buffered = 0;
+            }
+
+            for(; size >= STRIPE; in += STRIPE, size -= STRIPE)
+            {
+                stripe(in);
+            }
+
+            memcpy(m_buffer, in, size);
+            m_buffered = size;
+        }
+
+        void updateValue(uint64_t value)
+        {
+            update(&value, sizeof(value));
+        }
+
+        // Hash of everything added so far, more can be added afterwards
+        uint64_t digest() const
+        {
+            ContentHash state = *this;
+
+            if(state.m_buffered > 0)
+            {
+                memset(state.m_buffer + state.m_buffered, 0, STRIPE - state.m_buffered);   // The length below tells the zeros apart
+                state.stripe(state.m_buffer);
+            }
+
+            uint64_t hash = m_seed + HASH_PRIME64_5 + m_length * HASH_PRIME64_1;
+
+            for(int i = 0; i < 8; i++)
+            {
+                uint64_t lane = rotateLeft64(state.m_acc[i] * HASH_PRIME64_2, 31) * HASH_PRIME64_1;
+                hash = (hash ^ lane) * HASH_PRIME64_1 + HASH_PRIME64_4;
+            }
+
+            return hashAvalanche(hash);
+        }
+    };
+
+    // Hash of the pixels of a view (not the row padding) and its size. Blocks of rows are hashed in parallel and the block hashes hashed
+    // again, the block size is fixed so the result does not depend on the thread count.
+    inline uint64_t hashView(const ConstImageView &view, int thread_count = 0)
+    {
+        const int block_rows = 64;
+        int blocks = view.valid() ? (view.height + block_rows - 1) / block_rows : 0;
+        std::vector<uint64_t> block_hashes(blocks);
+        size_t row_bytes = (size_t)view.width * view.channels;
+
+        parallelRows(0, blocks, thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency(), [&](int, int start, int end) {
+            for(int block = start; block < end; block++)
+            {
+                ContentHash hash((uint64_t)block);
+                int last = std::min(view.height, (block + 1) * block_rows);
+
+                for(int row = block * block_rows; row < last; row++)
+                {
+                    hash.update(view.data + (size_t)row * view.stride, row_bytes);
+                }
+
+                block_hashes[block] = hash.digest();
+            }
+        });
+
+        ContentHash hash;
+        hash.updateValue((uint64_t)view.width);
+        hash.updateValue((uint64_t)view.height);
+        hash.updateValue((uint64_t)view.channels);
+        hash.update(block_hashes.data(), block_hashes.size() * sizeof(uint64_t));
+        return hash.digest();
+    }
+
+    // Canonical hash of a convolution: kernel size and weights, the padding of the input and the tone mapping applied to the result.
+    // Bump FILTER_CACHE_VERSION whenever the output of the kernel code changes, so results of the old code are not found any more.
+    const uint64_t FILTER_CACHE_VERSION = 1;
+
+    inline uint64_t hashKernel(const std::vector<std::vector<float>> &kernel, int padding, const PointOps* point_ops)
+    {
+        ContentHash hash(FILTER_CACHE_VERSION);
+        hash.updateValue((uint64_t)kernel.size());
+        hash.updateValue((uint64_t)padding);
+
+        for(const std::vector<float> &row : kernel)
+        {
+            hash.updateValue((uint64_t)row.size());
+
+            for(float weight : row)
+            {
+                weight = weight == 0.0f ? 0.0f : weight;    // -0 and 0 give the same result
+                hash.update(&weight, sizeof(weight));
+            }
+        }
+
+        bool has_point_ops = point_ops != nullptr && !point_ops->isIdentity();
+        hash.updateValue(has_point_ops ? 1 : 0);
+
+        for(int c = 0; c < 4 && has_point_ops; c++)
+        {
+            hash.update(point_ops->getLut(c), 256);
+        }
+
+        return hash.digest();
+    }
+
+    // Input hash and operation hash, 128 bits together
+    struct FilterCacheKey
+    {
+        uint64_t input = 0;
+        uint64_t operation = 0;
+
+        bool operator==(const FilterCacheKey &other) const
+        {
+            return input == other.input && operation == other.operation;
+        }
+
+        // 32 hex digits, the file name in the cache directory
+        std::string hex() const
+        {
+            char text[33];
+            snprintf(text, sizeof(text), "%016llx%016llx", (unsigned long long)input, (unsigned long long)operation);
+            return text;
+        }
+    };
+
+    struct FilterCacheKeyHash
+    {
+        size_t operator()(const FilterCacheKey &key) const
+        {
+            return (size_t)(key.input ^ rotateLeft64(key.operation, 17));
+        }
+    };
+
+    struct FilterCacheStats
+    {
+        uint64_t hits = 0;          // Memory and disk
+        uint64_t disk_hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+        uint64_t bytes_saved = 0;   // Result bytes returned from the cache instead of being filtered again
+        size_t entries = 0;
+        size_t bytes = 0;           // Results held in memory
+        size_t budget = 0;
+
+        double hitRate() const
+        {
+            return hits + misses > 0 ? (double)hits / (double)(hits + misses) : 0.0;
+        }
+
+        void print(std::ostream &out = std::cout) const
+        {
+            std::ios::fmtflags flags = out.flags();
+            std::streamsize precision = out.precision();
+
+            out << std::fixed << std::setprecision(0) << "filter cache: " << hits << " hits (" << disk_hits << " from disk), " << misses << " misses, "
+                << hitRate() * 100.0 << "% hit rate, " << std::setprecision(1) << bytes_saved / (1024.0 * 1024.0) << " MB saved, " << stores
+                << " stored, " << evictions << " evictions, " << entries << " results, " << bytes / (1024.0 * 1024.0) << " of "
+                << budget / (1024.0 * 1024.0) << " MB\n";
+
+            out.flags(flags);
+            out.precision(precision);
+        }
+    };
+
+    // Opt-in cache of filter results by input content and operation (see Image::setFilterCache). Results are kept in memory under a byte
+    // budget, least recently used first out, and with a directory also as .afraw files there, which outlive the process and are shared by
+    // every process using the same directory. The directory is not size limited, clear it by hand. Thread-safe.
+    class FilterCache
+    {
+    private:
+        struct Entry
+        {
+            FilterCacheKey key;
+            std::shared_ptr<std::vector<unsigned char>> data;  // Tightly packed rows
+            int width = 0;
+            int height = 0;
+            int channels = 0;
+        };
+
+        std::list<Entry> m_entries;     // Most recently used first
+        std::unordered_map<FilterCacheKey, std::list<Entry>::iterator, FilterCacheKeyHash> m_index;
+        std::string m_directory;
+        FilterCacheStats m_stats;
+        std::mutex m_mutex;
+
+        // Drop least recently used entries until bytes more fit into the budget (the mutex is held)
+        void evict(size_t bytes)
+        {
+            while(!m_entries.empty() && m_stats.bytes + bytes > m_stats.budget)
+            {
+                Entry &entry = m_entries.back();
+                m_stats.bytes -= entry.data->size();
+                m_stats.evictions++;
+                m_index.erase(entry.key);
+                m_entries.pop_back();
+            }
+
+            m_stats.entries = m_entries.size();
+        }
+
+        // Add an entry to memory if it fits into the budget (the mutex is held)
+        void insert(Entry entry)
+        {
+            size_t bytes = entry.data->size();
+
+            if(bytes > m_stats.budget || m_index.count(entry.key) > 0)
+            {
+                return;
+            }
+
+            evict(bytes);
+            m_stats.bytes += bytes;
+            m_entries.push_front(std::move(entry));
+            m_index[m_entries.front().key] = m_entries.begin();
+            m_stats.entries = m_entries.size();
+        }
+
+        std::string filePath(const std::string &directory, const FilterCacheKey &key) const
+        {
+            return directory + "/" + key.hex() + ".afraw";
+        }
+
+        // Read a result file of the size of dst into packed rows, false if there is none
+        bool readFile(const std::string &path, const ImageView &dst, std::vector<unsigned char> &data)
+        {
+#if defined(AF_HAS_AFRAW_IO)
+            int fd = open(path.c_str(), O_RDONLY);
+
+            if(fd < 0)
+            {
+                return false;
+            }
+
+            struct stat file_stat;
+            AfRawHeader header;
+            size_t row_bytes = (size_t)dst.width * dst.channels;
+            bool ok = fstat(fd, &file_stat) == 0 &&
+                      pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                      afRawHeaderValid(header, (uint64_t)file_stat.st_size) &&
+                      (int)header.width == dst.width && (int)header.height == dst.height && (int)header.channels == dst.channels &&
+                      header.stride == row_bytes;
+
+            if(ok)
+            {
+                data.resize(header.data_size);
+                size_t total = 0;
+
+                while(total < data.size())
+                {
+                    ssize_t count = pread(fd, data.data() + total, data.size() - total, (off_t)(header.data_offset + total));
+
+                    if(count <= 0)
+                    {
+                        break;
+                    }
+
+                    total += (size_t)count;
+                }
+
+                ok = total == data.size();
+            }
+
+            close(fd);
+            return ok;
+#else
+            return false;
+#endif
+        }
+
+        // Write a result file next to its final name and rename it, so other processes never see a partly written file
+        void writeFile(const std::string &path, const Entry &entry)
+        {
+#if defined(AF_HAS_AFRAW_IO)
+            static std::atomic<uint64_t> counter(0);
+            std::string temporary = path + ".tmp." + std::to_string((long long)getpid()) + "." + std::to_string((unsigned long long)counter++);
+            int row_bytes = entry.width * entry.channels;
+
+            if(writeAfRaw(temporary.c_str(), entry.data->data(), entry.width, entry.height, entry.channels, row_bytes, 1))
+            {
+                if(rename(temporary.c_str(), path.c_str()) == 0)
+                {
+                    return;
+                }
+            }
+
+            unlink(temporary.c_str());
+#endif
+        }
+
+    public:
+        static const size_t DEFAULT_BUDGET = (size_t)256 * 1024 * 1024;
+
+        // directory: where results are also stored on disk, empty = memory only (it has to exist)
+        explicit FilterCache(size_t budget = DEFAULT_BUDGET, const std::string &directory = "")
+        {
+            m_stats.budget = budget;
+            m_directory = directory;
+        }
+
+        FilterCache(const FilterCache&) = delete;
+        FilterCache& operator=(const FilterCache&) = delete;
+
+        // Process-wide cache, memory only until setDirectory()
+        static FilterCache& global()
+        {
+            static FilterCache cache;
+            return cache;
+        }
+
+        // Key of a convolution of input (including its padding) with kernel and point_ops
+        static FilterCacheKey key(const ImageView &input, const std::vector<std::vector<float>> &kernel, int padding,
+                                  const PointOps* point_ops, int thread_count = 0)
+        {
+            FilterCacheKey key;
+            key.input = hashView(input, thread_count);
+            key.operation = hashKernel(kernel, padding, point_ops);
+            return key;
+        }
+
+        // Copy a cached result into dst, false if there is none of its size
+        bool lookup(const FilterCacheKey &key, const ImageView &dst, int thread_count = 0)
+        {
+            if(!dst.valid())
+            {
+                return false;
+            }
+
+            size_t bytes = (size_t)dst.width * dst.height * dst.channels;
+            Entry entry;
+            std::string directory;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto found = m_index.find(key);
+
+                if(found != m_index.end() && found->second->width == dst.width && found->second->height == dst.height &&
+                   found->second->channels == dst.channels)
+                {
+                    m_stats.hits++;
+                    m_stats.bytes_saved += bytes;
+                    m_entries.splice(m_entries.begin(), m_entries, found->second);
+                    entry = *found->second;
+                }
+
+                directory = m_directory;
+            }
+
+            if(entry.data != nullptr)
+            {
+                copyView(ImageView{entry.data->data(), entry.width, entry.height, entry.width * entry.channels, entry.channels}, dst, thread_count);
+                return true;
+            }
+
+            std::vector<unsigned char> data;
+
+            if(directory.empty() || !readFile(filePath(directory, key), dst, data))
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stats.misses++;
+                return false;
+            }
+
+            entry.key = key;
+            entry.data = std::make_shared<std::vector<unsigned char>>(std::move(data));
+            entry.width = dst.width;
+            entry.height = dst.height;
+            entry.channels = dst.channels;
+            copyView(ImageView{entry.data->data(), entry.width, entry.height, entry.width * entry.channels, entry.channels}, dst, thread_count);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.hits++;
+            m_stats.disk_hits++;
+            m_stats.bytes_saved += bytes;
+            insert(std::move(entry));
+            return true;
+        }
+
+        // Keep a copy of the result of key, in memory if it fits into the budget and in the directory if there is one
+        void store(const FilterCacheKey &key, const ImageView &result, int thread_count = 0)
+        {
+            if(!result.valid())
+            {
+                return;
+            }
+
+            Entry entry;
+            entry.key = key;
+            entry.width = result.width;
+            entry.height = result.height;
+            entry.channels = result.channels;
+            entry.data = std::make_shared<std::vector<unsigned char>>((size_t)result.width * result.height * result.channels);
+            copyView(result, ImageView{entry.data->data(), entry.width, entry.height, entry.width * entry.channels, entry.channels}, thread_count);
+            std::string directory;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stats.stores++;
+                directory = m_directory;
+                insert(entry);
+            }
+
+            if(!directory.empty())
+            {
+                writeFile(filePath(directory, key), entry);
+            }
+        }
+
+        // Change the budget, evicts right away if the cache holds more
+        void setBudget(size_t budget)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.budget = budget;
+            evict(0);
+        }
+
+        // Also store results in a directory (which has to exist), empty = memory only
+        void setDirectory(const std::string &directory)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_directory = directory;
+        }
+
+        // Drop every result held in memory, the files in the directory stay
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_entries.clear();
+            m_index.clear();
+            m_stats.bytes = 0;
+            m_stats.entries = 0;
+        }
+
+        FilterCacheStats getStats()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_stats;
+        }
+
+        void resetCounters()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.hits = 0;
+            m_stats.disk_hits = 0;
+            m_stats.misses = 0;
+            m_stats.stores = 0;
+            m_stats.evictions = 0;
+            m_stats.bytes_saved = 0;
+        }
+    };
+};
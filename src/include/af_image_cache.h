@@ -0,0 +1,350 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstdio>
+
+#include "af_image_threads.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+
+namespace af
+{
+    // Identity of a file version: a cached image is only used while the file still has the same size and modification time
+    struct FileStamp
+    {
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+
+        bool operator==(const FileStamp &other) const
+        {
+            return size == other.size && mtime_ns == other.mtime_ns;
+        }
+    };
+
+    // Get the stamp of a file, false if it does not exist
+    inline bool fileStamp(const char* path, FileStamp &stamp)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        struct stat file_stat;
+
+        if(path == nullptr || stat(path, &file_stat) != 0)
+        {
+            return false;
+        }
+
+        stamp.size = (uint64_t)file_stat.st_size;
+#if defined(__APPLE__)
+        stamp.mtime_ns = (int64_t)file_stat.st_mtimespec.tv_sec * 1000000000 + file_stat.st_mtimespec.tv_nsec;
+#else
+        stamp.mtime_ns = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+#endif
+        return true;
+#else
+        FILE* file = path != nullptr ? fopen(path, "rb") : nullptr;
+
+        if(file == nullptr)
+        {
+            return false;
+        }
+
+        fseek(file, 0, SEEK_END);
+        stamp.size = (uint64_t)ftell(file);     // No portable modification time, the size alone has to do
+        fclose(file);
+        return true;
+#endif
+    }
+
+    // Shared handle on a decoded image of an ImageCache. The pixels stay alive as long as a handle exists, even after the cache evicted
+    // them, and are shared by every handle of the same file and every later get() of it, so they are read-only: clone() to modify them.
+    class CachedImage
+    {
+    private:
+        std::shared_ptr<Image> m_image;
+
+    public:
+        CachedImage() = default;
+
+        explicit CachedImage(std::shared_ptr<Image> image) : m_image(std::move(image))
+        {
+        }
+
+        bool valid() const
+        {
+            return m_image != nullptr && m_image->getImage() != nullptr;
+        }
+
+        int getWidth() const
+        {
+            return m_image != nullptr ? m_image->getWidth() : 0;
+        }
+
+        int getHeight() const
+        {
+            return m_image != nullptr ? m_image->getHeight() : 0;
+        }
+
+        int getChannels() const
+        {
+            return m_image != nullptr ? m_image->getChannels() : 0;
+        }
+
+        // Read-only access to a row of the shared pixels
+        const unsigned char* getRow(int row) const
+        {
+            return m_image != nullptr ? m_image->getRow(row) : nullptr;
+        }
+
+        // Read-only view of the shared pixels, e.g. for copyView() or hashView()
+        ConstImageView view() const
+        {
+            return m_image != nullptr ? ConstImageView(m_image->view()) : ConstImageView();
+        }
+
+        // Deep copy that can be modified
+        Image clone() const
+        {
+            return m_image != nullptr ? m_image->clone() : Image();
+        }
+
+        // Bytes the decoded image takes
+        size_t bytes() const
+        {
+            return m_image != nullptr ? (size_t)m_image->getStride() * m_image->getHeight() : 0;
+        }
+    };
+
+    struct ImageCacheStats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;        // Not cached or the file changed, decoded
+        uint64_t reloads = 0;       // Misses because the file changed since it was cached
+        uint64_t evictions = 0;
+        uint64_t failures = 0;      // Files that could not be decoded
+        size_t entries = 0;
+        size_t bytes = 0;           // Decoded images held by the cache
+        size_t budget = 0;
+
+        double hitRate() const
+        {
+            return hits + misses > 0 ? (double)hits / (double)(hits + misses) : 0.0;
+        }
+
+        void print(std::ostream &out = std::cout) const
+        {
+            std::ios::fmtflags flags = out.flags();
+            std::streamsize precision = out.precision();
+
+            out << std::fixed << std::setprecision(0) << "image cache: " << hits << " hits, " << misses << " misses (" << reloads << " reloads, "
+                << failures << " failed), " << hitRate() * 100.0 << "% hit rate, " << evictions << " evictions, " << entries << " images, "
+                << std::setprecision(1) << bytes / (1024.0 * 1024.0) << " of " << budget / (1024.0 * 1024.0) << " MB\n";
+
+            out.flags(flags);
+            out.precision(precision);
+        }
+    };
+
+    // Decoded images by path under a byte budget, least recently used ones are evicted first. A file is decoded again when its size or
+    // modification time changed. Thread-safe; decoding runs outside the lock, so two threads missing the same file at once both decode it.
+    class ImageCache
+    {
+    private:
+        struct Entry
+        {
+            std::string path;
+            FileStamp stamp;
+            std::shared_ptr<Image> image;
+            size_t bytes = 0;
+        };
+
+        std::list<Entry> m_entries;     // Most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+        ImageCacheStats m_stats;
+        std::mutex m_mutex;
+
+        // Drop least recently used entries until bytes more fit into the budget (the mutex is held)
+        void evict(size_t bytes)
+        {
+            while(!m_entries.empty() && m_stats.bytes + bytes > m_stats.budget)
+            {
+                Entry &entry = m_entries.back();
+                m_stats.bytes -= entry.bytes;
+                m_stats.evictions++;
+                m_index.erase(entry.path);
+                m_entries.pop_back();
+            }
+
+            m_stats.entries = m_entries.size();
+        }
+
+    public:
+        static const size_t DEFAULT_BUDGET = (size_t)256 * 1024 * 1024;
+
+        explicit ImageCache(size_t budget = DEFAULT_BUDGET)
+        {
+            m_stats.budget = budget;
+        }
+
+        ImageCache(const ImageCache&) = delete;
+        ImageCache& operator=(const ImageCache&) = delete;
+
+        // Process-wide cache
+        static ImageCache& global()
+        {
+            static ImageCache cache;
+            return cache;
+        }
+
+        // Get the decoded image of a file, from the cache if the file did not change. An invalid handle if it cannot be decoded.
+        CachedImage get(const char* path)
+        {
+            FileStamp stamp;
+
+            if(path == nullptr || !fileStamp(path, stamp))
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stats.misses++;
+                m_stats.failures++;
+                return CachedImage();
+            }
+
+            std::string key(path);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto found = m_index.find(key);
+
+                if(found != m_index.end())
+                {
+                    if(found->second->stamp == stamp)
+                    {
+                        m_stats.hits++;
+                        m_entries.splice(m_entries.begin(), m_entries, found->second);
+                        return CachedImage(found->second->image);
+                    }
+
+                    // Left alone if another thread already cached a newer version than the one this thread saw
+                    if(found->second->stamp.mtime_ns <= stamp.mtime_ns)
+                    {
+                        m_stats.reloads++;
+                        m_stats.bytes -= found->second->bytes;
+                        m_entries.erase(found->second);
+                        m_index.erase(found);
+                        m_stats.entries = m_entries.size();
+                    }
+                }
+
+                m_stats.misses++;
+            }
+
+            std::shared_ptr<Image> image = std::make_shared<Image>();
+            image->load(path);
+
+            if(image->getImage() == nullptr)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stats.failures++;
+                return CachedImage();
+            }
+
+            Entry entry;
+            entry.path = key;
+            entry.stamp = stamp;
+            entry.image = image;
+            entry.bytes = (size_t)image->getStride() * image->getHeight();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto found = m_index.find(key);
+
+            if(found != m_index.end())
+            {
+                // Another thread decoded it meanwhile: share its image if it is the same version of the file, otherwise keep whichever
+                // version is newer in the cache (the caller still gets the version it asked for)
+                if(found->second->stamp == stamp)
+                {
+                    m_entries.splice(m_entries.begin(), m_entries, found->second);
+                    return CachedImage(found->second->image);
+                }
+
+                if(found->second->stamp.mtime_ns > stamp.mtime_ns)
+                {
+                    return CachedImage(image);
+                }
+
+                m_stats.bytes -= found->second->bytes;
+                m_entries.erase(found->second);
+                m_index.erase(found);
+                m_stats.entries = m_entries.size();
+            }
+
+            if(entry.bytes <= m_stats.budget)
+            {
+                evict(entry.bytes);
+                m_stats.bytes += entry.bytes;
+                m_entries.push_front(std::move(entry));
+                m_index[key] = m_entries.begin();
+                m_stats.entries = m_entries.size();
+            }
+
+            return CachedImage(image);
+        }
+
+        // Change the budget, evicts right away if the cache holds more
+        void setBudget(size_t budget)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.budget = budget;
+            evict(0);
+        }
+
+        // Forget one file (e.g. after writing it)
+        void invalidate(const char* path)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto found = m_index.find(path != nullptr ? path : "");
+
+            if(found != m_index.end())
+            {
+                m_stats.bytes -= found->second->bytes;
+                m_entries.erase(found->second);
+                m_index.erase(found);
+                m_stats.entries = m_entries.size();
+            }
+        }
+
+        // Drop every image, handles that are still out keep theirs
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_entries.clear();
+            m_index.clear();
+            m_stats.bytes = 0;
+            m_stats.entries = 0;
+        }
+
+        ImageCacheStats getStats()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_stats;
+        }
+
+        void resetCounters()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.hits = 0;
+            m_stats.misses = 0;
+            m_stats.reloads = 0;
+            m_stats.evictions = 0;
+            m_stats.failures = 0;
+        }
+    };
+};
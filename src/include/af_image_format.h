@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstring>
+#include <cctype>
+
+
+namespace af
+{
+    // File formats Image::write can produce
+    enum class ImageFormat
+    {
+        Auto,       // Pick from the file extension, JPEG if unknown
+        Jpeg,
+        Png,
+        Bmp,
+        Tga,
+        Ppm,        // Binary PPM (3 channels) or PGM (1 channel), uncompressed, 8 or 16 bits per sample
+        Pfm,        // Portable float map, 32-bit float samples
+        Qoi,        // Lossless RGB / RGBA, encodes and decodes many times faster than PNG
+        AfRaw       // Native uncompressed format, see af_afraw.h
+    };
+
+    // Encoder settings of Image::write
+    struct WriteOptions
+    {
+        ImageFormat format = ImageFormat::Auto;
+        int jpeg_quality = 100;         // 1..100, up to 90 the chroma is subsampled
+        int png_level = 8;              // Deflate level 0..9, 0 stores the data uncompressed ("store" deflate)
+        int png_filter = -1;            // 0..4 forces one PNG filter, -1 picks the best one per row
+        bool tga_rle = true;
+        int pnm_bits = 8;               // Bits per sample of PPM / PGM: 8 or 16
+
+        // Cheapest settings for every format, for scratch outputs: stored PNG without filtering, subsampled JPEG, raw TGA
+        static WriteOptions fastest()
+        {
+            WriteOptions options;
+            options.jpeg_quality = 90;
+            options.png_level = 0;
+            options.png_filter = 0;
+            options.tga_rle = false;
+            return options;
+        }
+    };
+
+    // Get the format of a file name from its extension (case-insensitive), ImageFormat::Auto if unknown
+    inline ImageFormat formatFromPath(const char* path)
+    {
+        const char* dot = path != nullptr ? strrchr(path, '.') : nullptr;
+
+        if(dot == nullptr || strchr(dot, '/') != nullptr)
+        {
+            return ImageFormat::Auto;
+        }
+
+        char extension[8] = {};
+
+        for(int i = 0; i < 7 && dot[i + 1] != 0; i++)
+        {
+            extension[i] = (char)tolower((unsigned char)dot[i + 1]);
+        }
+
+        static const struct { const char* extension; ImageFormat format; } formats[] = {
+            {"jpg", ImageFormat::Jpeg}, {"jpeg", ImageFormat::Jpeg}, {"png", ImageFormat::Png}, {"bmp", ImageFormat::Bmp},
+            {"tga", ImageFormat::Tga}, {"ppm", ImageFormat::Ppm}, {"pgm", ImageFormat::Ppm}, {"pnm", ImageFormat::Ppm},
+            {"pfm", ImageFormat::Pfm}, {"qoi", ImageFormat::Qoi}, {"afraw", ImageFormat::AfRaw}
+        };
+
+        for(const auto &entry : formats)
+        {
+            if(strcmp(extension, entry.extension) == 0)
+            {
+                return entry.format;
+            }
+        }
+
+        return ImageFormat::Auto;
+    }
+
+    // Name of a format for reports
+    inline const char* formatName(ImageFormat format)
+    {
+        switch(format)
+        {
+            case ImageFormat::Jpeg: return "jpeg";
+            case ImageFormat::Png: return "png";
+            case ImageFormat::Bmp: return "bmp";
+            case ImageFormat::Tga: return "tga";
+            case ImageFormat::Ppm: return "ppm";
+            case ImageFormat::Pfm: return "pfm";
+            case ImageFormat::Qoi: return "qoi";
+            case ImageFormat::AfRaw: return "afraw";
+            default: return "auto";
+        }
+    }
+};
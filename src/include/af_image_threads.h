@@ -7,11 +7,44 @@
 
 #ifndef STB_IMAGE_WRITE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "af_deflate.h"
+#ifndef STBIW_ZLIB_COMPRESS
+#define STBIW_ZLIB_COMPRESS af::stbiwZlibCompress  // PNG compression goes through the parallel deflate
+#endif
 #include "stb_image_write.h"
 #endif
 
 #include <vector>
 #include <thread>
+#include <functional>
+#include <mutex>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "af_parallel.h"
+#include "af_image_view.h"
+#include "af_buffer_pool.h"
+#include "af_allocator.h"
+#include "af_point_ops.h"
+#include "af_composite.h"
+#include "af_rolling_kernel.h"
+#include "af_filter_cache.h"
+#include "af_afraw.h"
+#include "af_copy.h"
+#include "af_padding.h"
+#include "af_buffered_writer.h"
+#include "af_jpeg_encoder.h"
+#include "af_png_encoder.h"
+#include "af_image_format.h"
+#include "af_pnm.h"
+#include "af_qoi.h"
+#include "af_probe.h"
+#include "af_jpeg_decoder.h"
+#include "af_batch_planner.h"
 
 
 namespace af
@@ -45,6 +78,13 @@ namespace af
         uint8_t a;
     };
 
+    // Per-channel histogram of an 8-bit image (up to 4 channels)
+    struct Histogram
+    {
+        int channels = 0;
+        uint64_t count[4][256] = {};
+    };
+
 
     class Image
     {
@@ -53,327 +93,1610 @@ namespace af
         int m_width;
         int m_height;
         int m_channels;
+        int m_stride;       // Bytes from the start of one row to the next, every row starts at a ALIGNMENT byte boundary
         int m_padding = 0;  // If the image is padded / padding has been applied and saved in the current image-object, this defines the padding per side (at the moment only padding wich has the same size for each side is supported)
         int m_thread_count;
+        bool m_owner = true;    // False if the image only wraps memory owned by someone else (see Image(ImageView))
+        BufferPool* m_pool = nullptr;           // Pool create() takes new buffers from, nullptr = allocate them following m_alloc_options
+        BufferPool* m_buffer_pool = nullptr;    // Pool the current buffer has to go back to
+        AllocOptions m_alloc_options;           // Allocation policy for buffers which do not come from a pool
+        Allocation m_allocation;                // How the current buffer was allocated
+        bool m_read_only = false;               // The buffer is a read-only file mapping (see mapFile), writing to it crashes
         std::vector<std::vector<float>> m_kernel;
         Image* m_kernel_image;
+        const PointOps* m_kernel_point_ops = nullptr;   // Optional tone mapping fused into the write-out of kernelThread
+        FilterCache* m_filter_cache = nullptr;          // Results of applyKernel are looked up and stored here, nullptr = no caching
+
+        // Take over the buffer and properties of another image and leave it empty
+        void moveFrom(Image &other) noexcept
+        {
+            m_image = other.m_image;
+            m_width = other.m_width;
+            m_height = other.m_height;
+            m_channels = other.m_channels;
+            m_stride = other.m_stride;
+            m_padding = other.m_padding;
+            m_thread_count = other.m_thread_count;
+            m_owner = other.m_owner;
+            m_pool = other.m_pool;
+            m_buffer_pool = other.m_buffer_pool;
+            m_alloc_options = other.m_alloc_options;
+            m_allocation = other.m_allocation;
+            m_read_only = other.m_read_only;
+            m_filter_cache = other.m_filter_cache;
+
+            other.m_image = nullptr;
+            other.m_width = 0;
+            other.m_height = 0;
+            other.m_channels = 0;
+            other.m_stride = 0;
+            other.m_padding = 0;
+            other.m_owner = true;
+            other.m_buffer_pool = nullptr;
+            other.m_allocation = Allocation();
+            other.m_read_only = false;
+        }
+
+        // Free the current buffer or hand it back to its pool, wrapped memory is left alone
+        void releaseBuffer()
+        {
+            if(m_image != nullptr && m_owner)
+            {
+                if(m_buffer_pool != nullptr)
+                {
+                    m_buffer_pool->release(m_image, m_allocation.size);
+                }
+                else
+                {
+                    deallocate(m_allocation);
+                }
+            }
+
+            m_image = nullptr;
+            m_owner = true;
+            m_buffer_pool = nullptr;
+            m_allocation = Allocation();
+            m_read_only = false;
+        }
+
+        // Pool newly constructed images take their buffers from
+        static BufferPool*& defaultPool()
+        {
+            static BufferPool* pool = nullptr;
+            return pool;
+        }
+
+        // Filter cache of newly constructed images
+        static FilterCache*& defaultFilterCache()
+        {
+            static FilterCache* cache = nullptr;
+            return cache;
+        }
+
+        // Allocation policy of newly constructed images
+        static AllocOptions& defaultAllocOptions()
+        {
+            static AllocOptions options;
+            return options;
+        }
+
+        // Clip the overlay placed at (x, y) against the current image and run func(dst, src, mask, pixels) on every overlapping row, parallel over the rows
+        void blendRegion(Image* overlay, Image* mask, int x, int y, const std::function<void(unsigned char*, const unsigned char*, const unsigned char*, int)> &func)
+        {
+            int left = std::max(0, x);
+            int top = std::max(0, y);
+            int right = std::min(m_width, x + overlay->getWidth());
+            int bottom = std::min(m_height, y + overlay->getHeight());
+
+            if(left >= right || top >= bottom)
+            {
+                return;
+            }
+
+            parallelRows(top, bottom, m_thread_count, [&](int, int start_row, int end_row) {
+                for(int row = start_row; row < end_row; row++)
+                {
+                    int overlay_row = row - y;
+                    unsigned char* dst = m_image + (size_t)row * m_stride + left * m_channels;
+                    const unsigned char* src = overlay->getImage() + (size_t)overlay_row * overlay->getStride() + (left - x) * m_channels;
+                    const unsigned char* mask_row = mask != nullptr ? mask->getImage() + (size_t)overlay_row * mask->getStride() + (left - x) : nullptr;
+                    func(dst, src, mask_row, right - left);
+                }
+            });
+        }
+
+        // Get the pixels as tightly packed rows, copied into buffer only if the rows have padding
+        const unsigned char* packedRows(std::vector<unsigned char> &buffer)
+        {
+            if(m_stride == m_width * m_channels)
+            {
+                return m_image;
+            }
+
+            buffer.resize((size_t)m_width * m_height * m_channels);
+
+            for(int row = 0; row < m_height; row++)
+            {
+                memcpy(buffer.data() + (size_t)row * m_width * m_channels, m_image + (size_t)row * m_stride, (size_t)m_width * m_channels);
+            }
+
+            return buffer.data();
+        }
+
+        // Move the rows of a buffer decoded by stb_image into aligned, strided storage and free it
+        bool adoptDecoded(unsigned char* decoded, int width, int height, int channels)
+        {
+            if(decoded == nullptr)
+            {
+                return false;
+            }
+
+            create(width, height, channels);
+            copyView(ImageView{decoded, width, height, width * channels, channels}, view(), m_thread_count);
+            stbi_image_free(decoded);
+            return true;
+        }
 
     public:
+        static const int ALIGNMENT = 64;    // Row alignment (in bytes), a cache line and the widest vector register
+
         Image()
         {
             m_image = nullptr;
+            m_width = 0;
+            m_height = 0;
+            m_channels = 0;
+            m_stride = 0;
             m_thread_count = std::thread::hardware_concurrency();
+            m_pool = defaultPool();
+            m_alloc_options = defaultAllocOptions();
+            m_filter_cache = defaultFilterCache();
         }
 
-        ~Image()
+        // Wrap an existing buffer without taking ownership, so every filter can read from or write into a view
+        explicit Image(const ImageView &view)
         {
-            if(m_image != nullptr)
-            {
-                free(m_image);
-                m_image = nullptr;
-            }
+            m_image = view.data;
+            m_width = view.width;
+            m_height = view.height;
+            m_channels = view.channels;
+            m_stride = view.stride;
+            m_owner = false;
+            m_thread_count = std::thread::hardware_concurrency();
         }
 
-        // Load image from file
-        void load(const char* path)
+        // Copying would share (and double free) the pixel buffer, use clone() for a deep copy
+        Image(const Image&) = delete;
+        Image& operator=(const Image&) = delete;
+
+        // Moving hands the pixel buffer over without copying it
+        Image(Image &&other) noexcept
         {
-            m_image = stbi_load(path, &m_width, &m_height, &m_channels, 0);
+            moveFrom(other);
         }
 
-        // Create image from scratch
-        void create(int width, int height, int channels)
+        Image& operator=(Image &&other) noexcept
         {
-            m_width = width;
-            m_height = height;
-            m_channels = channels;
-            m_image = (unsigned char*)malloc(width * height * channels);
+            if(this != &other)
+            {
+                destroy();
+                moveFrom(other);
+            }
+
+            return *this;
         }
 
-        // Get the size (in bytes)
-        int getSize()
+        ~Image()
         {
-            return (m_width * m_height * m_channels);
+            releaseBuffer();
         }
 
-        // Get the width
-        int getWidth()
+        // Take the buffers of this image from a pool (nullptr = allocate them directly), applies to the next create()
+        void setPool(BufferPool* pool)
         {
-            return m_width;
+            m_pool = pool;
         }
 
-        // Get the height
-        int getHeight()
+        // Set the pool every image constructed afterwards takes its buffers from, e.g. &BufferPool::global()
+        static void setDefaultPool(BufferPool* pool)
         {
-            return m_height;
+            defaultPool() = pool;
         }
 
-        // Get the number of channels
-        int getChannels()
+        // Look up the results of applyKernel in a cache before filtering and store them there afterwards, nullptr = always filter
+        void setFilterCache(FilterCache* cache)
         {
-            return m_channels;
+            m_filter_cache = cache;
         }
 
-        // Get the padding per side
-        int getPadding()
+        // Set the filter cache of every image constructed afterwards, e.g. &FilterCache::global()
+        static void setDefaultFilterCache(FilterCache* cache)
         {
-            return m_padding;
+            defaultFilterCache() = cache;
         }
 
-        // Get the pointer to the image
-        unsigned char* getImage()
+        // Set how the buffers of this image are allocated (huge pages, pre-faulting, mlock), applies to the next create() without a pool
+        void setAllocOptions(const AllocOptions &options)
         {
-            return m_image;
+            m_alloc_options = options;
         }
 
-        // Get the values of a single pixel, rgb version
-        rgb getPixelRgb(int row, int col)
+        // Set the allocation policy of every image constructed afterwards
+        static void setDefaultAllocOptions(const AllocOptions &options)
         {
-            return {
-                *(m_image + (row * col * m_channels)),
-                *(m_image + (row * col * m_channels) + 1),
-                *(m_image + (row * col * m_channels) + 2)
-            };
+            defaultAllocOptions() = options;
         }
 
-        // Get the values of a single pixel, rgba version
-        rgba getPixelRgba(int row, int col)
+        // Get how the current buffer was allocated
+        const Allocation& getAllocation()
         {
-            return {
-                *(m_image + (row * col * m_channels)),
-                *(m_image + (row * col * m_channels) + 1),
-                *(m_image + (row * col * m_channels) + 2),
-                *(m_image + (row * col * m_channels) + 3)
-            };
+            return m_allocation;
         }
 
-        // Set the pixel on an rgb image
-        void setPixelRgb(int row, int col, rgb value)
+        // Read the dimensions and format of an image file without decoding it
+        static ImageInfo probe(const char* path)
         {
-            *(m_image + (row * m_width * m_channels) + (col * m_channels)) = value.r;
-            *(m_image + (row * m_width * m_channels) + (col * m_channels) + 1) = value.g;
-            *(m_image + (row * m_width * m_channels) + (col * m_channels) + 2) = value.b;
+            return probeFile(path);
         }
 
-        // Set the pixel on an rgba image
-        void setPixelRgba(int row, int col, rgba value)
+        // Read the dimensions and format of an encoded image in memory without decoding it
+        static ImageInfo probe(const unsigned char* data, size_t size)
         {
-            *(m_image + (row * m_width * m_channels) + (col * m_channels)) = value.r;
-            *(m_image + (row * m_width * m_channels) + (col * m_channels) + 1) = value.g;
-            *(m_image + (row * m_width * m_channels) + (col * m_channels) + 2) = value.b;
-            *(m_image + (row * m_width * m_channels) + (col * m_channels) + 3) = value.a;
+            return probeMemory(data, size);
         }
 
-        // Set a 8-bit value
-        void setRaw(int position, unsigned char value)
+        // Load an image from file and return it
+        static Image fromFile(const char* path)
         {
-            *(m_image + position) = value;
+            Image image;
+            image.load(path);
+            return image;
         }
 
-        // Copy the current image to another image object
-        void copy(Image* image)
+        // Map an .afraw file and use its pixels directly as the image buffer, nothing is decoded or copied. The mapping is read-only unless
+        // copy_on_write is set, then the image can be modified in memory (touched pages become private copies, the file never changes)
+        bool mapFile(const char* path, bool copy_on_write = false)
         {
-            // First check dimensions. TODO: Error-handling
-            if((*image).getWidth() != m_width ||
-               (*image).getHeight() != m_height ||
-               (*image).getChannels() != m_channels)
+#if defined(AF_HAS_AFRAW_IO)
+            int fd = open(path, O_RDONLY);
+            struct stat file_stat;
+            AfRawHeader header;
+
+            if(fd < 0)
             {
-                return;
+                return false;
             }
 
-            for(int i = 0; i < (m_width * m_height * m_channels); i++)
+            if(fstat(fd, &file_stat) != 0 ||
+               pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+               !afRawHeaderValid(header, (uint64_t)file_stat.st_size))
             {
-                (*image).setRaw(i, *(m_image + i));
+                close(fd);
+                return false;
             }
+
+            size_t mapping_size = header.data_offset + header.data_size;
+            void* mapping = mmap(nullptr, mapping_size, copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);  // The mapping keeps the file alive
+
+            if(mapping == MAP_FAILED)
+            {
+                return false;
+            }
+
+            destroy();
+            m_width = header.width;
+            m_height = header.height;
+            m_channels = header.channels;
+            m_stride = header.stride;
+            m_image = (unsigned char*)mapping + header.data_offset;
+            m_allocation.data = m_image;
+            m_allocation.size = header.data_size;
+            m_allocation.mapping = mapping;
+            m_allocation.mapping_size = mapping_size;
+            m_read_only = !copy_on_write;
+            return true;
+#else
+            return false;
+#endif
         }
 
-        // Copy the current iamge to another image object, rgb version
-        void copyRgb(Image* image)
+        // Write the image as .afraw (header + the rows as they are in memory), the counterpart of mapFile
+        bool writeRaw(const char* path)
         {
-            // First check dimensions. TODO: Error-handling
-            if((*image).getWidth() != m_width ||
-               (*image).getHeight() != m_height ||
-               (*image).getChannels() != m_channels ||
-               m_channels != 3)
+#if defined(AF_HAS_AFRAW_IO)
+            if(m_image == nullptr)
             {
-                return;
+                return false;
             }
 
-            for(int row = 0; row < m_height; row++)
+            return writeAfRaw(path, m_image, m_width, m_height, m_channels, m_stride, ALIGNMENT);
+#else
+            return false;
+#endif
+        }
+
+        // True if the buffer is a read-only mapping
+        bool isReadOnly()
+        {
+            return m_read_only;
+        }
+
+        // Load image from file, the decoded rows are moved into aligned, strided storage
+        void load(const char* path)
+        {
+            ImageFormat format = formatFromPath(path);
+
+            if(((format == ImageFormat::Ppm || format == ImageFormat::Pfm) && loadPnm(path)) || (format == ImageFormat::Qoi && loadMapped(path)))
             {
-                for(int col = 0; col < m_width; col++)
-                {
-                    (*image).setPixelRgb(row, col, {
-                        *(m_image + (row * m_width * m_channels) + (col * m_channels)),
-                        *(m_image + (row * m_width * m_channels) + (col * m_channels) + 1),
-                        *(m_image + (row * m_width * m_channels) + (col * m_channels) + 2)
-                    });
-                }
+                return;
             }
+
+            int width, height, channels;
+            unsigned char* decoded = stbi_load(path, &width, &height, &channels, 0);
+            adoptDecoded(decoded, width, height, channels);
         }
 
-        // Pad the image and copy to new image object, rgb version, padding is inteded as padding per side
-        void padImageRgb(Image* image, int padding)
+        // Decode an image that is already in memory (any format stb_image reads), returns false if it could not be decoded
+        bool loadFromMemory(const unsigned char* data, size_t size)
         {
-            // TODO: Error handling, process does not work if no image is loaded or the padding is larger than the image itself
-            if(!m_width || !m_image || padding > m_width || padding > m_height)
+            if(data == nullptr || size == 0 || size > (size_t)INT32_MAX)
             {
-                return;
+                return false;
             }
 
-            int new_width = m_width + padding * 2;
-            int new_height = m_height + padding * 2;
+            PnmHeader header;
+            QoiHeader qoi;
 
-            image->destroy();    // First destroy everything inside the new image object
-            image->create(new_width, new_height, m_channels);  // Then allocate the new image using the padded image-size
-            unsigned char* new_image = image->getImage();   // Write directly to the memory, bypassing all method calls
-            
-            for(int row = 0; row < new_height; row++)
+            if(parsePnmHeader(data, size, header) == 1 && header.header_size + header.dataSize() <= size)
             {
-                int original_row = row - padding;
+                create(header.width, header.height, header.channels);
+                pnmToView(header, data + header.header_size, view(), m_thread_count);
+                return true;
+            }
 
-                // TODO: Branchless version!
-                if(row < padding)
-                {
-                    original_row = padding - row - 1;
-                }
-                else if(row >= (m_height + padding))
+            if(parseQoiHeader(data, size, qoi))
+            {
+                create(qoi.width, qoi.height, qoi.channels);
+
+                if(!qoiDecode(data, size, qoi, view()))
                 {
-                    original_row = m_height - (row - padding - m_height) - 1;
+                    destroy();
+                    return false;
                 }
 
-                for(int col = 0; col < new_width; col++)
-                {
-                    int original_col = col - padding;
+                return true;
+            }
 
-                    // TODO: Branchless version!
-                    if(col < padding)
-                    {
-                        original_col = padding - col - 1;
-                    }
-                    else if(col >= (m_width + padding))
-                    {
-                        original_col = m_width - (col - padding - m_width) - 1;
-                    }
+            int width, height, channels;
+            unsigned char* decoded = stbi_load_from_memory(data, (int)size, &width, &height, &channels, 0);
+            return adoptDecoded(decoded, width, height, channels);
+        }
 
-                    // Copy old pixel to new image
-                    *(new_image + (row * new_width + col) * m_channels) = *(m_image + (original_row * m_width + original_col) * m_channels);
-                    *(new_image + (row * new_width + col) * m_channels + 1) = *(m_image + (original_row * m_width + original_col) * m_channels + 1);
-                    *(new_image + (row * new_width + col) * m_channels + 2) = *(m_image + (original_row * m_width + original_col) * m_channels + 2);
-                }
+        // Map a file and decode straight from the mapping, no stdio buffering and no copy of the encoded file (read whole without mmap)
+        bool loadMapped(const char* path)
+        {
+#if defined(AF_HAS_AFRAW_IO)
+            int fd = open(path, O_RDONLY);
+            struct stat file_stat;
+
+            if(fd < 0)
+            {
+                return false;
+            }
+
+            if(fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0)
+            {
+                close(fd);
+                return false;
+            }
+
+            size_t size = (size_t)file_stat.st_size;
+            void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);  // The mapping keeps the file alive
+
+            if(mapping == MAP_FAILED)
+            {
+                return false;
+            }
+
+            madvise(mapping, size, MADV_SEQUENTIAL);    // The decoders read front to back
+            bool ok = loadFromMemory((const unsigned char*)mapping, size);
+            munmap(mapping, size);
+            return ok;
+#else
+            FILE* file = path != nullptr ? fopen(path, "rb") : nullptr;
+            std::vector<unsigned char> data;
+
+            if(file == nullptr)
+            {
+                return false;
             }
 
-            image->setPadding(padding);
+            fseek(file, 0, SEEK_END);
+            long size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+            data.resize(size > 0 ? (size_t)size : 0);
+            bool ok = fread(data.data(), 1, data.size(), file) == data.size() && loadFromMemory(data.data(), data.size());
+            fclose(file);
+            return ok;
+#endif
         }
 
-        // Just set the padding property
-        void setPadding(int padding)
+        // Read a binary PGM / PPM (8 or 16 bits) or PFM file, mapped and converted straight into the image buffer. "-" reads stdin.
+        bool loadPnm(const char* path)
         {
-            m_padding = padding;
+#if defined(AF_HAS_AFRAW_IO)
+            if(path != nullptr && strcmp(path, "-") == 0)
+            {
+                return loadPnm(STDIN_FILENO);
+            }
+#endif
+            return loadMapped(path);
         }
 
-        // Get the total sum of a kernel
-        float getKernelSum(std::vector<std::vector<float>> &kernel)
+        // Read a binary PGM / PPM or PFM from a file descriptor, e.g. a pipe from another process. 8-bit samples are read with one
+        // large read() into the image buffer and the rows moved to their aligned places afterwards, nothing is copied in between.
+        bool loadPnm(int fd)
         {
-            float sum = 0;
+#if defined(AF_HAS_AFRAW_IO)
+            PnmHeader header;
+            std::vector<unsigned char> head;
 
-            for(int row = 0; row < kernel.size(); row++)
+            if(!readPnmHeader(fd, header, head))
             {
-                for(int col = 0; col < kernel.at(row).size(); col++)
-                {
-                    sum += kernel.at(row).at(col);
-                }
+                return false;
             }
 
-            return sum;
-        }
+            size_t data_size = header.dataSize();
+            size_t buffered = std::min(head.size() - header.header_size, data_size);
 
-        void kernelThread(int start_row, int end_row)
-        {
-            float kernel_sum = getKernelSum(m_kernel);
-            kernel_sum = kernel_sum == 0 ? 1 : kernel_sum;
-            rgb_float current_pixel_sum = {0.0F,0.0F,0.0F};
-            int row, col, kernel_row, kernel_col;   // Declare counter variables to prevent reallocation of (stack) memory over and over again
-            int row_offset, col_offset;     // How many rows / cols is the current pixel distant from the center one?
-            int center = (m_kernel.size() - 1) / 2;
-            int new_width = m_kernel_image->getWidth();
-            unsigned char* new_image = m_kernel_image->getImage();
-            
-            for(row = start_row; row < end_row; row++)
+            if(header.is_float || header.maxval != 255)
             {
-                for(col = m_padding; col < (m_width - m_padding); col++)
+                std::vector<unsigned char> samples(data_size);
+                memcpy(samples.data(), head.data() + header.header_size, buffered);
+
+                if(readAll(fd, samples.data() + buffered, data_size - buffered) != data_size - buffered)
                 {
-                    current_pixel_sum = {0.0F,0.0F,0.0F};
+                    return false;
+                }
 
-                    for(kernel_row = 0; kernel_row < m_kernel.size(); kernel_row++)
-                    {
-                        row_offset = kernel_row - center;
+                create(header.width, header.height, header.channels);
+                pnmToView(header, samples.data(), view(), m_thread_count);
+                return true;
+            }
 
-                        for(kernel_col = 0; kernel_col < m_kernel.at(kernel_row).size(); kernel_col++)
-                        {
-                            col_offset = kernel_col - center;
-                            current_pixel_sum.r += *(m_image + (row + row_offset) * m_width * m_channels + (col + col_offset) * m_channels) * m_kernel.at(kernel_row).at(kernel_col);
-                            current_pixel_sum.g += *(m_image + (row + row_offset) * m_width * m_channels + (col + col_offset) * m_channels + 1) * m_kernel.at(kernel_row).at(kernel_col);
-                            current_pixel_sum.b += *(m_image + (row + row_offset) * m_width * m_channels + (col + col_offset) * m_channels + 2) * m_kernel.at(kernel_row).at(kernel_col);
-                        }
-                    }
-                    
-                    current_pixel_sum.r = (int)(current_pixel_sum.r / kernel_sum);
-                    current_pixel_sum.g = (int)(current_pixel_sum.g / kernel_sum);
-                    current_pixel_sum.b = (int)(current_pixel_sum.b / kernel_sum);
+            create(header.width, header.height, header.channels);
+            memcpy(m_image, head.data() + header.header_size, buffered);
 
-                    if(current_pixel_sum.r < 0) {current_pixel_sum.r = 0;}
-                    if(current_pixel_sum.r > 255) {current_pixel_sum.r = 255;}
-                    if(current_pixel_sum.g < 0) {current_pixel_sum.g = 0;}
-                    if(current_pixel_sum.g > 255) {current_pixel_sum.g = 255;}
-                    if(current_pixel_sum.b < 0) {current_pixel_sum.b = 0;}
-                    if(current_pixel_sum.b > 255) {current_pixel_sum.b = 255;}
-                    
-                    *(new_image + (row - m_padding) * new_width * m_channels + (col - m_padding) * m_channels) = (uint8_t)current_pixel_sum.r;
-                    *(new_image + (row - m_padding) * new_width * m_channels + (col - m_padding) * m_channels + 1) = (uint8_t)current_pixel_sum.g;
-                    *(new_image + (row - m_padding) * new_width * m_channels + (col - m_padding) * m_channels + 2) = (uint8_t)current_pixel_sum.b;
-                }
+            if(readAll(fd, m_image + buffered, data_size - buffered) != data_size - buffered)
+            {
+                destroy();
+                return false;
             }
-        }
 
-        // Apply a kernel to the current (padded) image and save into a new image object
-        void applyKernel(std::vector<std::vector<float>> &kernel, Image* image)
-        {
-            if(kernel.size() % 2 == 0 ||
-               (kernel.size() - 1) / 2 > m_padding ||
-               kernel.at(0).size() % 2 == 0 ||
-               (kernel.at(0).size() - 1) / 2 > m_padding ||
-               m_width != (image->getWidth() + m_padding * 2) ||
-               m_height != (image->getHeight() + m_padding * 2))
+            // The rows were read packed, spread them to the stride from the bottom up so no row is overwritten before it moved
+            size_t row_bytes = header.rowBytes();
+
+            for(int row = m_height - 1; row > 0 && row_bytes != (size_t)m_stride; row--)
             {
-                return; // TODO: Error-handling
+                memmove(m_image + (size_t)row * m_stride, m_image + row * row_bytes, row_bytes);
             }
 
-            m_kernel = kernel;
-            m_kernel_image = image;
-            int rows_per_thread = (int)(m_height - m_padding * 2) / m_thread_count;
-            int rows_last_thread = rows_per_thread + (m_height - m_padding * 2) % m_thread_count;
-            std::vector<std::thread> threads;
+            return true;
+#else
+            return false;
+#endif
+        }
 
-            for(int i = 0; i < m_thread_count; i++)
+        // Write a binary PGM / PPM (bits 8 or 16) or PFM (bits 32, linear 0..1 floats), "-" writes to stdout
+        bool writePnm(const char* path, int bits = 8)
+        {
+#if defined(AF_HAS_AFRAW_IO)
+            if(path != nullptr && strcmp(path, "-") == 0)
             {
-                int rows_current_thread = i < (m_thread_count - 1) ? rows_per_thread : rows_last_thread;
-                int start_row = rows_per_thread * i + m_padding;
-                int end_row = start_row + rows_current_thread;
-
-                threads.push_back(std::thread(&Image::kernelThread, this, start_row, end_row));
+                return writePnm(STDOUT_FILENO, bits);
             }
 
-            for(int i = 0; i < m_thread_count; i++)
+            int fd = path != nullptr ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+
+            if(fd < 0)
             {
-                threads.at(i).join();
+                return false;
             }
+
+            bool ok = writePnm(fd, bits);
+            ok = (close(fd) == 0) && ok;
+            return ok;
+#else
+            return false;
+#endif
+        }
+
+        // Write a binary PGM / PPM or PFM to a file descriptor, e.g. a pipe to another process
+        bool writePnm(int fd, int bits = 8)
+        {
+#if defined(AF_HAS_AFRAW_IO)
+            return m_image != nullptr && af::writePnm(fd, view(), bits, m_thread_count);
+#else
+            return false;
+#endif
+        }
+
+        // Decode through custom read/skip/eof callbacks (see stbi_io_callbacks), user is passed to them
+        bool loadFromCallbacks(const stbi_io_callbacks &callbacks, void* user)
+        {
+            int width, height, channels;
+            unsigned char* decoded = stbi_load_from_callbacks(&callbacks, user, &width, &height, &channels, 0);
+            return adoptDecoded(decoded, width, height, channels);
         }
 
+        // Decode a JPEG at 1/2, 1/4 or 1/8 of its size with reduced IDCTs, for thumbnails and previews (scale 1 is a full decode).
+        // Much cheaper than load() and a downscale; returns false for other formats.
+        bool loadScaled(const char* path, int scale)
+        {
+            int width, height, channels;
+            unsigned char* decoded = jpegDecodeScaledFromFile(path, scale, &width, &height, &channels);
+            return adoptDecoded(decoded, width, height, channels);
+        }
 
-        // Write image to file TODO: Support multiple image formats
-        void write(const char* path)
+        // Scaled decode of a JPEG that is already in memory, see loadScaled
+        bool loadScaledFromMemory(const unsigned char* data, size_t size, int scale)
         {
-            stbi_write_jpg(path, m_width, m_height, m_channels, m_image, 100);
+            int width, height, channels;
+            unsigned char* decoded = jpegDecodeScaledFromMemory(data, size, scale, &width, &height, &channels);
+            return adoptDecoded(decoded, width, height, channels);
+        }
+
+        // Decode only a region of a JPEG (a crop or a band of a huge image): the decoder streams its rows straight into this image and
+        // never holds the whole picture, see jpegDecodeRows. Returns false for other formats.
+        bool loadRegion(const char* path, const JpegRegion &region)
+        {
+            bool created = false;
+
+            JpegStreamStats stats = jpegDecodeRowsFromFile(path, region, 16, [&](const JpegRowBatch &batch) {
+                if(!created)
+                {
+                    create(batch.region.width, batch.region.height, batch.channels);
+                    created = true;
+                }
+
+                for(int i = 0; i < batch.count; i++)
+                {
+                    memcpy(m_image + (size_t)(batch.row - batch.region.y + i) * m_stride, batch.data + (size_t)i * batch.stride, batch.stride);
+                }
+            });
+
+            return stats.ok && created;
+        }
+
+        // Get the row stride for a width and channel count, rounded up to a multiple of ALIGNMENT
+        static int alignedStride(int width, int channels)
+        {
+            return ((width * channels + ALIGNMENT - 1) / ALIGNMENT) * ALIGNMENT;
+        }
+
+        // Create image from scratch
+        void create(int width, int height, int channels)
+        {
+            destroy();  // Release a previous buffer
+            m_width = width;
+            m_height = height;
+            m_channels = channels;
+            m_stride = alignedStride(width, channels);
+            size_t size = std::max<size_t>((size_t)m_stride * height, ALIGNMENT);
+
+            if(m_pool != nullptr)
+            {
+                m_image = m_pool->acquire(size);
+                m_buffer_pool = m_pool;
+                m_allocation.data = m_image;
+                m_allocation.size = size;
+            }
+            else
+            {
+                m_allocation = allocate(size, m_alloc_options, ALIGNMENT);
+                m_image = m_allocation.data;
+            }
+
+            if(m_image == nullptr)
+            {
+                releaseBuffer();    // Out of memory, leave the image empty
+                m_width = 0;
+                m_height = 0;
+                m_channels = 0;
+                m_stride = 0;
+            }
+        }
+
+        // Get the size of the pixel data without the row padding (in bytes)
+        int getSize()
+        {
+            return (m_width * m_height * m_channels);
+        }
+
+        // Get the row stride (in bytes)
+        int getStride()
+        {
+            return m_stride;
+        }
+
+        // Get the pointer to the first byte of a row
+        unsigned char* getRow(int row)
+        {
+            return m_image + (size_t)row * m_stride;
+        }
+
+        // Get a view of the whole image
+        ImageView view()
+        {
+            return {m_image, m_width, m_height, m_stride, m_channels};
+        }
+
+        // Get a view of a sub-rectangle, no pixels are copied
+        ImageView crop(int x, int y, int width, int height)
+        {
+            return view().crop(x, y, width, height);
+        }
+
+        // Get a view of the image without its padding
+        ImageView interior()
+        {
+            return crop(m_padding, m_padding, m_width - m_padding * 2, m_height - m_padding * 2);
+        }
+
+        // Get the width
+        int getWidth()
+        {
+            return m_width;
+        }
+
+        // Get the height
+        int getHeight()
+        {
+            return m_height;
+        }
+
+        // Get the number of channels
+        int getChannels()
+        {
+            return m_channels;
+        }
+
+        // Get the padding per side
+        int getPadding()
+        {
+            return m_padding;
+        }
+
+        // Get the pointer to the image
+        unsigned char* getImage()
+        {
+            return m_image;
+        }
+
+        // Get the values of a single pixel, rgb version
+        rgb getPixelRgb(int row, int col)
+        {
+            return {
+                *(m_image + (row * m_stride) + (col * m_channels)),
+                *(m_image + (row * m_stride) + (col * m_channels) + 1),
+                *(m_image + (row * m_stride) + (col * m_channels) + 2)
+            };
+        }
+
+        // Get the values of a single pixel, rgba version
+        rgba getPixelRgba(int row, int col)
+        {
+            return {
+                *(m_image + (row * m_stride) + (col * m_channels)),
+                *(m_image + (row * m_stride) + (col * m_channels) + 1),
+                *(m_image + (row * m_stride) + (col * m_channels) + 2),
+                *(m_image + (row * m_stride) + (col * m_channels) + 3)
+            };
+        }
+
+        // Set the pixel on an rgb image
+        void setPixelRgb(int row, int col, rgb value)
+        {
+            *(m_image + (row * m_stride) + (col * m_channels)) = value.r;
+            *(m_image + (row * m_stride) + (col * m_channels) + 1) = value.g;
+            *(m_image + (row * m_stride) + (col * m_channels) + 2) = value.b;
+        }
+
+        // Set the pixel on an rgba image
+        void setPixelRgba(int row, int col, rgba value)
+        {
+            *(m_image + (row * m_stride) + (col * m_channels)) = value.r;
+            *(m_image + (row * m_stride) + (col * m_channels) + 1) = value.g;
+            *(m_image + (row * m_stride) + (col * m_channels) + 2) = value.b;
+            *(m_image + (row * m_stride) + (col * m_channels) + 3) = value.a;
+        }
+
+        // Set a 8-bit value, position is the byte offset into the buffer (row * stride + col * channels + channel)
+        void setRaw(int position, unsigned char value)
+        {
+            *(m_image + position) = value;
+        }
+
+        // Copy the current image to another image object
+        void copy(Image* image)
+        {
+            // First check dimensions. TODO: Error-handling
+            if((*image).getWidth() != m_width ||
+               (*image).getHeight() != m_height ||
+               (*image).getChannels() != m_channels)
+            {
+                return;
+            }
+
+            copyView(view(), (*image).view(), m_thread_count);
+        }
+
+        // Get a deep copy of the current image (the copy always owns its buffer)
+        Image clone()
+        {
+            Image image;
+
+            if(m_image != nullptr)
+            {
+                image.create(m_width, m_height, m_channels);
+                copy(&image);
+                image.setPadding(m_padding);
+            }
+
+            return image;
+        }
+
+        // Copy the current image into a view with the same dimensions
+        void copy(const ImageView &view)
+        {
+            Image target(view);
+            copy(&target);
+        }
+
+        // Copy the current iamge to another image object, rgb version
+        void copyRgb(Image* image)
+        {
+            // First check dimensions. TODO: Error-handling
+            if((*image).getWidth() != m_width ||
+               (*image).getHeight() != m_height ||
+               (*image).getChannels() != m_channels ||
+               m_channels != 3)
+            {
+                return;
+            }
+
+            copyView(view(), (*image).view(), m_thread_count);
+        }
+
+        // Copy the current image into another image object with a different channel layout (RGB <-> BGR, RGB <-> RGBA), the target is (re)allocated.
+        // Swapping RGB <-> BGR or RGBA <-> BGRA also works in place (image = this)
+        void convertChannels(Image* image, ChannelConversion conversion)
+        {
+            int src_channels = (conversion == ChannelConversion::RgbToBgr || conversion == ChannelConversion::RgbToRgba) ? 3 : 4;
+            int dst_channels = (conversion == ChannelConversion::RgbToBgr || conversion == ChannelConversion::RgbaToRgb) ? 3 : 4;
+
+            if(m_image == nullptr || m_channels != src_channels || (image == this && src_channels != dst_channels))
+            {
+                return; // TODO: Error-handling
+            }
+
+            if(image != this &&
+               (image->getWidth() != m_width || image->getHeight() != m_height || image->getChannels() != dst_channels || image->getImage() == nullptr))
+            {
+                image->create(m_width, m_height, dst_channels);
+            }
+
+            convertView(conversion, view(), image->view(), m_thread_count);
+        }
+
+        // Pad the image and copy to new image object, rgb version, padding is inteded as padding per side (mirrored edges, PadMode::Reflect)
+        void padImageRgb(Image* image, int padding)
+        {
+            // TODO: Error handling, process does not work if no image is loaded or the padding is larger than the image itself
+            if(!m_width || !m_image || padding > m_width || padding > m_height)
+            {
+                return;
+            }
+
+            padImage(image, Borders{padding, padding, padding, padding}, PadMode::Reflect);
+        }
+
+        // Pad the image and return the padded image
+        Image padded(int padding, PadMode mode = PadMode::Reflect)
+        {
+            Image image;
+            image.setFilterCache(m_filter_cache);   // So img.padded(1).filtered(kernel) uses the cache of img
+
+            if(m_image != nullptr && padding >= 0)
+            {
+                padImage(&image, Borders{padding, padding, padding, padding}, mode);
+            }
+
+            return image;
+        }
+
+        // Pad the image into an existing view which has to be padding * 2 larger than the image in both directions, nothing is allocated
+        void padImageRgb(const ImageView &view, int padding)
+        {
+            if(!m_width || !m_image || padding > m_width || padding > m_height)
+            {
+                return; // TODO: Error-handling
+            }
+
+            padImage(view, Borders{padding, padding, padding, padding}, PadMode::Reflect);
+        }
+
+        // Pad the image with any mode and per-side widths into another image object, which is (re)allocated. constant is used for PadMode::Constant.
+        // The padding property is only set for equal borders (the kernels need those)
+        void padImage(Image* image, Borders borders, PadMode mode = PadMode::Reflect, rgba constant = {0, 0, 0, 0})
+        {
+            if(m_image == nullptr || image == this)
+            {
+                return; // TODO: Error-handling
+            }
+
+            image->create(m_width + borders.left + borders.right, m_height + borders.top + borders.bottom, m_channels);
+            padImage(image->view(), borders, mode, constant);
+
+            bool symmetric = borders.left == borders.top && borders.left == borders.right && borders.left == borders.bottom;
+            image->setPadding(symmetric ? borders.left : 0);
+        }
+
+        // Pad the image into an existing view, which has to be larger by the borders, nothing is allocated
+        void padImage(const ImageView &view, Borders borders, PadMode mode = PadMode::Reflect, rgba constant = {0, 0, 0, 0})
+        {
+            unsigned char value[16] = {constant.r, constant.g, constant.b, constant.a};
+            padView(this->view(), view, borders, mode, value, m_thread_count);
+        }
+
+        // Rebuild the borders of a padded image from its interior (e.g. after filtering the interior), in place
+        void refreshPadding(PadMode mode = PadMode::Reflect, rgba constant = {0, 0, 0, 0})
+        {
+            if(m_image == nullptr || m_padding <= 0)
+            {
+                return;
+            }
+
+            unsigned char value[16] = {constant.r, constant.g, constant.b, constant.a};
+            padView(interior(), view(), Borders{m_padding, m_padding, m_padding, m_padding}, mode, value, m_thread_count);
+        }
+
+        // Just set the padding property
+        void setPadding(int padding)
+        {
+            m_padding = padding;
+        }
+
+        // Get the total sum of a kernel
+        float getKernelSum(std::vector<std::vector<float>> &kernel)
+        {
+            float sum = 0;
+
+            for(int row = 0; row < kernel.size(); row++)
+            {
+                for(int col = 0; col < kernel.at(row).size(); col++)
+                {
+                    sum += kernel.at(row).at(col);
+                }
+            }
+
+            return sum;
+        }
+
+        void kernelThread(int start_row, int end_row)
+        {
+            float kernel_sum = getKernelSum(m_kernel);
+            kernel_sum = kernel_sum == 0 ? 1 : kernel_sum;
+            rgb_float current_pixel_sum = {0.0F,0.0F,0.0F};
+            int row, col, kernel_row, kernel_col;   // Declare counter variables to prevent reallocation of (stack) memory over and over again
+            int row_offset, col_offset;     // How many rows / cols is the current pixel distant from the center one?
+            int center = (m_kernel.size() - 1) / 2;
+            int new_stride = m_kernel_image->getStride();
+            unsigned char* new_image = m_kernel_image->getImage();
+            const uint8_t* lut_r = m_kernel_point_ops != nullptr ? m_kernel_point_ops->getLut(0) : nullptr;
+            const uint8_t* lut_g = m_kernel_point_ops != nullptr ? m_kernel_point_ops->getLut(1) : nullptr;
+            const uint8_t* lut_b = m_kernel_point_ops != nullptr ? m_kernel_point_ops->getLut(2) : nullptr;
+            
+            for(row = start_row; row < end_row; row++)
+            {
+                for(col = m_padding; col < (m_width - m_padding); col++)
+                {
+                    current_pixel_sum = {0.0F,0.0F,0.0F};
+
+                    for(kernel_row = 0; kernel_row < m_kernel.size(); kernel_row++)
+                    {
+                        row_offset = kernel_row - center;
+
+                        for(kernel_col = 0; kernel_col < m_kernel.at(kernel_row).size(); kernel_col++)
+                        {
+                            col_offset = kernel_col - center;
+                            current_pixel_sum.r += *(m_image + (row + row_offset) * m_stride + (col + col_offset) * m_channels) * m_kernel.at(kernel_row).at(kernel_col);
+                            current_pixel_sum.g += *(m_image + (row + row_offset) * m_stride + (col + col_offset) * m_channels + 1) * m_kernel.at(kernel_row).at(kernel_col);
+                            current_pixel_sum.b += *(m_image + (row + row_offset) * m_stride + (col + col_offset) * m_channels + 2) * m_kernel.at(kernel_row).at(kernel_col);
+                        }
+                    }
+                    
+                    current_pixel_sum.r = (int)(current_pixel_sum.r / kernel_sum);
+                    current_pixel_sum.g = (int)(current_pixel_sum.g / kernel_sum);
+                    current_pixel_sum.b = (int)(current_pixel_sum.b / kernel_sum);
+
+                    if(current_pixel_sum.r < 0) {current_pixel_sum.r = 0;}
+                    if(current_pixel_sum.r > 255) {current_pixel_sum.r = 255;}
+                    if(current_pixel_sum.g < 0) {current_pixel_sum.g = 0;}
+                    if(current_pixel_sum.g > 255) {current_pixel_sum.g = 255;}
+                    if(current_pixel_sum.b < 0) {current_pixel_sum.b = 0;}
+                    if(current_pixel_sum.b > 255) {current_pixel_sum.b = 255;}
+
+                    if(lut_r != nullptr)
+                    {
+                        current_pixel_sum.r = lut_r[(int)current_pixel_sum.r];
+                        current_pixel_sum.g = lut_g[(int)current_pixel_sum.g];
+                        current_pixel_sum.b = lut_b[(int)current_pixel_sum.b];
+                    }
+                    
+                    *(new_image + (row - m_padding) * new_stride + (col - m_padding) * m_channels) = (uint8_t)current_pixel_sum.r;
+                    *(new_image + (row - m_padding) * new_stride + (col - m_padding) * m_channels + 1) = (uint8_t)current_pixel_sum.g;
+                    *(new_image + (row - m_padding) * new_stride + (col - m_padding) * m_channels + 2) = (uint8_t)current_pixel_sum.b;
+                }
+            }
+        }
+
+        // Apply a kernel to the current (padded) image and save into a new image object, point_ops (optional) are applied to the result while it is written
+        void applyKernel(std::vector<std::vector<float>> &kernel, Image* image, const PointOps* point_ops = nullptr)
+        {
+            if(kernel.size() % 2 == 0 ||
+               (kernel.size() - 1) / 2 > m_padding ||
+               kernel.at(0).size() % 2 == 0 ||
+               (kernel.at(0).size() - 1) / 2 > m_padding ||
+               m_width != (image->getWidth() + m_padding * 2) ||
+               m_height != (image->getHeight() + m_padding * 2))
+            {
+                return; // TODO: Error-handling
+            }
+
+            m_kernel = kernel;
+            m_kernel_image = image;
+            m_kernel_point_ops = (point_ops != nullptr && !point_ops->isIdentity()) ? point_ops : nullptr;
+            FilterCacheKey cache_key;
+
+            if(m_filter_cache != nullptr)
+            {
+                cache_key = FilterCache::key(view(), kernel, m_padding, m_kernel_point_ops, m_thread_count);
+
+                if(m_filter_cache->lookup(cache_key, image->view(), m_thread_count))
+                {
+                    m_kernel_point_ops = nullptr;
+                    return;
+                }
+            }
+
+            parallelRows(m_padding, m_height - m_padding, m_thread_count, [this](int, int start_row, int end_row) {
+                kernelThread(start_row, end_row);
+            });
+
+            if(m_filter_cache != nullptr)
+            {
+                m_filter_cache->store(cache_key, image->view(), m_thread_count);
+            }
+
+            m_kernel_point_ops = nullptr;
+        }
+
+        // Apply a kernel to the current (padded) image and return the result
+        Image filtered(std::vector<std::vector<float>> &kernel, const PointOps* point_ops = nullptr)
+        {
+            Image image;
+            image.create(m_width - m_padding * 2, m_height - m_padding * 2, m_channels);
+            applyKernel(kernel, &image, point_ops);
+            return image;
+        }
+
+        // Apply a kernel to the current (padded) image and write the result into a view, e.g. the interior of another padded image
+        void applyKernel(std::vector<std::vector<float>> &kernel, const ImageView &view, const PointOps* point_ops = nullptr)
+        {
+            Image target(view);
+            applyKernel(kernel, &target, point_ops);
+        }
+
+        // Apply a kernel in place on the current (unpadded) image, edges are mirrored like padImageRgb does, only a ring buffer of kernel-height rows per thread is allocated
+        RollingKernelStats applyKernelInPlace(std::vector<std::vector<float>> &kernel, const PointOps* point_ops = nullptr)
+        {
+            if(m_image == nullptr)
+            {
+                return RollingKernelStats(); // TODO: Error-handling
+            }
+
+            int row_bytes = m_width * m_channels;
+
+            return convolveRows(kernel, m_width, m_height, m_channels,
+                [this, row_bytes](int row, unsigned char* dst) {
+                    memcpy(dst, m_image + (size_t)row * m_stride, row_bytes);
+                },
+                [this, row_bytes](int row, const unsigned char* src) {
+                    memcpy(m_image + (size_t)row * m_stride, src, row_bytes);
+                },
+                true, point_ops, m_thread_count);
+        }
+
+        // Apply a chain of point operations in one pass, image may be this image (in-place)
+        void applyPointOps(const PointOps &point_ops, Image* image)
+        {
+            if(m_image == nullptr ||
+               image->getWidth() != m_width ||
+               image->getHeight() != m_height ||
+               image->getChannels() != m_channels)
+            {
+                return; // TODO: Error-handling
+            }
+
+            parallelRows(0, m_height, m_thread_count, [this, &point_ops, image](int, int start_row, int end_row) {
+                const uint8_t* lut[4];
+
+                for(int c = 0; c < 4; c++)
+                {
+                    lut[c] = point_ops.getLut(PointOps::lutIndex(c, m_channels));
+                }
+
+                int row_bytes = m_width * m_channels;
+
+                for(int row = start_row; row < end_row; row++)
+                {
+                    const unsigned char* src = m_image + (size_t)row * m_stride;
+                    unsigned char* dst = image->getRow(row);
+
+                    if(m_channels == 1)
+                    {
+                        int i = 0;
+
+                        // Unrolled, the loads of the next lookups do not wait for the previous stores
+                        for(; i + 4 <= row_bytes; i += 4)
+                        {
+                            uint8_t v0 = lut[0][*(src + i)];
+                            uint8_t v1 = lut[0][*(src + i + 1)];
+                            uint8_t v2 = lut[0][*(src + i + 2)];
+                            uint8_t v3 = lut[0][*(src + i + 3)];
+                            *(dst + i) = v0;
+                            *(dst + i + 1) = v1;
+                            *(dst + i + 2) = v2;
+                            *(dst + i + 3) = v3;
+                        }
+
+                        for(; i < row_bytes; i++)
+                        {
+                            *(dst + i) = lut[0][*(src + i)];
+                        }
+                    }
+                    else
+                    {
+                        for(int i = 0; i < row_bytes; i += m_channels)
+                        {
+                            for(int c = 0; c < m_channels && c < 4; c++)
+                            {
+                                *(dst + i + c) = lut[c][*(src + i + c)];
+                            }
+                        }
+                    }
+                }
+            });
+        }
+
+        // Apply a chain of point operations and write the result into a view
+        void applyPointOps(const PointOps &point_ops, const ImageView &view)
+        {
+            Image target(view);
+            applyPointOps(point_ops, &target);
+        }
+
+        // Count the values of every channel, each thread fills its own sub-histograms which are merged at the end
+        Histogram histogram()
+        {
+            Histogram result;
+            result.channels = std::min(m_channels, 4);
+
+            if(m_image == nullptr || result.channels <= 0)
+            {
+                return result;
+            }
+
+            int threads = std::max(1, std::min(m_thread_count, m_height));
+            std::vector<Histogram> partial(threads);
+
+            parallelRows(0, m_height, threads, [this, &partial](int thread, int start_row, int end_row) {
+                // Four interleaved copies per channel, so runs of equal values do not hit the same counter back to back (store-forwarding stalls)
+                std::vector<uint32_t> sub(4 * 4 * 256, 0);
+                int channels = std::min(m_channels, 4);
+                int pixels_unrolled = m_width - m_width % 4;
+                int i, c;
+
+                for(int row = start_row; row < end_row; row++)
+                {
+                    const unsigned char* src = m_image + (size_t)row * m_stride;
+
+                    for(i = 0; i < pixels_unrolled; i += 4)
+                    {
+                        for(c = 0; c < channels; c++)
+                        {
+                            sub[(0 * 4 + c) * 256 + *(src + (i + 0) * m_channels + c)]++;
+                            sub[(1 * 4 + c) * 256 + *(src + (i + 1) * m_channels + c)]++;
+                            sub[(2 * 4 + c) * 256 + *(src + (i + 2) * m_channels + c)]++;
+                            sub[(3 * 4 + c) * 256 + *(src + (i + 3) * m_channels + c)]++;
+                        }
+                    }
+
+                    for(; i < m_width; i++)
+                    {
+                        for(c = 0; c < channels; c++)
+                        {
+                            sub[c * 256 + *(src + i * m_channels + c)]++;
+                        }
+                    }
+                }
+
+                Histogram &out = partial.at(thread);
+
+                for(c = 0; c < channels; c++)
+                {
+                    for(int value = 0; value < 256; value++)
+                    {
+                        out.count[c][value] = (uint64_t)sub[(0 * 4 + c) * 256 + value] + sub[(1 * 4 + c) * 256 + value] +
+                                              sub[(2 * 4 + c) * 256 + value] + sub[(3 * 4 + c) * 256 + value];
+                    }
+                }
+            });
+
+            for(int thread = 0; thread < threads; thread++)
+            {
+                for(int c = 0; c < result.channels; c++)
+                {
+                    for(int value = 0; value < 256; value++)
+                    {
+                        result.count[c][value] += partial.at(thread).count[c][value];
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        // Global histogram equalization, every colour channel gets its own mapping, alpha (4th channel) is copied unchanged
+        void equalize(Image* image)
+        {
+            if(m_image == nullptr ||
+               image->getWidth() != m_width ||
+               image->getHeight() != m_height ||
+               image->getChannels() != m_channels)
+            {
+                return; // TODO: Error-handling
+            }
+
+            Histogram hist = histogram();
+            uint64_t total = (uint64_t)m_width * m_height;
+            std::vector<std::array<uint8_t, 256>> lut(m_channels);
+
+            for(int c = 0; c < m_channels; c++)
+            {
+                for(int value = 0; value < 256; value++)
+                {
+                    lut.at(c)[value] = (uint8_t)value;
+                }
+
+                if(PointOps::lutIndex(c, m_channels) >= 3 || c >= hist.channels)
+                {
+                    continue;   // Alpha is left alone
+                }
+
+                uint64_t cdf = 0;
+                uint64_t cdf_min = 0;
+
+                for(int value = 0; value < 256 && cdf_min == 0; value++)
+                {
+                    cdf_min = hist.count[c][value];
+                }
+
+                if(total == cdf_min)
+                {
+                    continue;   // Flat channel, nothing to stretch
+                }
+
+                for(int value = 0; value < 256; value++)
+                {
+                    cdf += hist.count[c][value];
+                    uint64_t above = cdf > cdf_min ? cdf - cdf_min : 0;
+                    lut.at(c)[value] = (uint8_t)((above * 255 + (total - cdf_min) / 2) / (total - cdf_min));
+                }
+            }
+
+            parallelRows(0, m_height, m_thread_count, [this, &lut, image](int, int start_row, int end_row) {
+                for(int row = start_row; row < end_row; row++)
+                {
+                    const unsigned char* src = m_image + (size_t)row * m_stride;
+                    unsigned char* dst = image->getRow(row);
+
+                    for(int i = 0; i < m_width * m_channels; i += m_channels)
+                    {
+                        for(int c = 0; c < m_channels; c++)
+                        {
+                            *(dst + i + c) = lut[c][*(src + i + c)];
+                        }
+                    }
+                }
+            });
+        }
+
+        // Global histogram equalization into a view
+        void equalize(const ImageView &view)
+        {
+            Image target(view);
+            equalize(&target);
+        }
+
+        // Contrast limited adaptive histogram equalization, the image is split into tiles_x * tiles_y tiles with a clipped histogram each and every pixel interpolates bilinearly between the mappings of the four nearest tiles
+        void clahe(Image* image, int tiles_x = 8, int tiles_y = 8, float clip_limit = 2.0F)
+        {
+            if(m_image == nullptr ||
+               tiles_x < 1 || tiles_y < 1 ||
+               tiles_x > m_width || tiles_y > m_height ||
+               image->getWidth() != m_width ||
+               image->getHeight() != m_height ||
+               image->getChannels() != m_channels)
+            {
+                return; // TODO: Error-handling
+            }
+
+            int channels = PointOps::lutIndex(m_channels - 1, m_channels) == 3 ? m_channels - 1 : m_channels;    // Without alpha
+            std::vector<uint8_t> luts((size_t)tiles_x * tiles_y * channels * 256);
+
+            // Build the mapping of every tile, parallel over the rows of tiles
+            parallelRows(0, tiles_y, m_thread_count, [&](int, int start_tile, int end_tile) {
+                std::vector<uint32_t> hist(channels * 256);
+
+                for(int tile_row = start_tile; tile_row < end_tile; tile_row++)
+                {
+                    int y0 = tile_row * m_height / tiles_y;
+                    int y1 = (tile_row + 1) * m_height / tiles_y;
+
+                    for(int tile_col = 0; tile_col < tiles_x; tile_col++)
+                    {
+                        int x0 = tile_col * m_width / tiles_x;
+                        int x1 = (tile_col + 1) * m_width / tiles_x;
+                        uint32_t pixels = (uint32_t)(x1 - x0) * (y1 - y0);
+                        uint32_t limit = std::max(1U, (uint32_t)(clip_limit * pixels / 256));
+                        std::fill(hist.begin(), hist.end(), 0);
+
+                        for(int row = y0; row < y1; row++)
+                        {
+                            const unsigned char* src = m_image + (size_t)row * m_stride + x0 * m_channels;
+
+                            for(int col = x0; col < x1; col++, src += m_channels)
+                            {
+                                for(int c = 0; c < channels; c++)
+                                {
+                                    hist[c * 256 + *(src + c)]++;
+                                }
+                            }
+                        }
+
+                        for(int c = 0; c < channels; c++)
+                        {
+                            uint32_t* h = &hist[c * 256];
+                            uint32_t excess = 0;
+
+                            for(int value = 0; value < 256; value++)
+                            {
+                                if(h[value] > limit)
+                                {
+                                    excess += h[value] - limit;
+                                    h[value] = limit;
+                                }
+                            }
+
+                            // Hand the clipped counts back to all bins evenly, the remainder goes to every n-th bin
+                            uint32_t bonus = excess / 256;
+                            uint32_t remainder = excess % 256;
+                            uint32_t step = remainder > 0 ? std::max(1U, 256 / remainder) : 1;
+
+                            for(int value = 0; value < 256; value++)
+                            {
+                                h[value] += bonus;
+                            }
+
+                            for(uint32_t value = 0; remainder > 0 && value < 256; value += step, remainder--)
+                            {
+                                h[value]++;
+                            }
+
+                            uint8_t* lut = &luts[(((size_t)tile_row * tiles_x + tile_col) * channels + c) * 256];
+                            uint64_t cdf = 0;
+
+                            for(int value = 0; value < 256; value++)
+                            {
+                                cdf += h[value];
+                                lut[value] = (uint8_t)std::min<uint64_t>(255, (cdf * 255 + pixels / 2) / pixels);
+                            }
+                        }
+                    }
+                }
+            });
+
+            // Interpolate between the tile mappings, the tile centers are the interpolation grid
+            parallelRows(0, m_height, m_thread_count, [&](int, int start_row, int end_row) {
+                std::vector<int> col_tile(m_width);
+                std::vector<float> col_weight(m_width);
+
+                for(int col = 0; col < m_width; col++)
+                {
+                    float position = ((col + 0.5F) * tiles_x / m_width) - 0.5F;
+                    int tile = (int)std::floor(position);
+                    col_weight[col] = tile < 0 ? 0.0F : (tile >= tiles_x - 1 ? 1.0F : position - tile);
+                    col_tile[col] = std::max(0, std::min(tile, std::max(0, tiles_x - 2)));
+
+                    if(tiles_x == 1)
+                    {
+                        col_weight[col] = 0.0F;
+                    }
+                }
+
+                for(int row = start_row; row < end_row; row++)
+                {
+                    float position = ((row + 0.5F) * tiles_y / m_height) - 0.5F;
+                    int tile_top = (int)std::floor(position);
+                    float weight_y = tile_top < 0 ? 0.0F : (tile_top >= tiles_y - 1 ? 1.0F : position - tile_top);
+                    tile_top = std::max(0, std::min(tile_top, std::max(0, tiles_y - 2)));
+                    int tile_bottom = std::min(tile_top + 1, tiles_y - 1);
+
+                    if(tiles_y == 1)
+                    {
+                        weight_y = 0.0F;
+                    }
+
+                    const unsigned char* src = m_image + (size_t)row * m_stride;
+                    unsigned char* dst = image->getRow(row);
+
+                    for(int col = 0; col < m_width; col++, src += m_channels, dst += m_channels)
+                    {
+                        int tile_left = col_tile[col];
+                        int tile_right = std::min(tile_left + 1, tiles_x - 1);
+                        float weight_x = col_weight[col];
+
+                        for(int c = 0; c < channels; c++)
+                        {
+                            int value = *(src + c);
+                            float top_left = luts[(((size_t)tile_top * tiles_x + tile_left) * channels + c) * 256 + value];
+                            float top_right = luts[(((size_t)tile_top * tiles_x + tile_right) * channels + c) * 256 + value];
+                            float bottom_left = luts[(((size_t)tile_bottom * tiles_x + tile_left) * channels + c) * 256 + value];
+                            float bottom_right = luts[(((size_t)tile_bottom * tiles_x + tile_right) * channels + c) * 256 + value];
+                            float top = top_left + (top_right - top_left) * weight_x;
+                            float bottom = bottom_left + (bottom_right - bottom_left) * weight_x;
+                            *(dst + c) = (uint8_t)(top + (bottom - top) * weight_y + 0.5F);
+                        }
+
+                        for(int c = channels; c < m_channels; c++)
+                        {
+                            *(dst + c) = *(src + c);
+                        }
+                    }
+                }
+            });
+        }
+
+
+        // CLAHE into a view
+        void clahe(const ImageView &view, int tiles_x = 8, int tiles_y = 8, float clip_limit = 2.0F)
+        {
+            Image target(view);
+            clahe(&target, tiles_x, tiles_y, clip_limit);
+        }
+
+        // Multiply the colour channels by alpha, rgba only, the blend operations expect premultiplied images
+        void premultiply()
+        {
+            if(m_image == nullptr || m_channels != 4)
+            {
+                return;
+            }
+
+            parallelRows(0, m_height, m_thread_count, [this](int, int start_row, int end_row) {
+                for(int row = start_row; row < end_row; row++)
+                {
+                    premultiplyRow(m_image + (size_t)row * m_stride, m_width);
+                }
+            });
+        }
+
+        // Undo premultiply(), rgba only
+        void unpremultiply()
+        {
+            if(m_image == nullptr || m_channels != 4)
+            {
+                return;
+            }
+
+            parallelRows(0, m_height, m_thread_count, [this](int, int start_row, int end_row) {
+                for(int row = start_row; row < end_row; row++)
+                {
+                    unpremultiplyRow(m_image + (size_t)row * m_stride, m_width);
+                }
+            });
+        }
+
+        // Blend a (smaller) premultiplied rgba image onto the current one with its top left corner at (x, y), only the overlapping rows are touched
+        void composite(Image* overlay, int x, int y, BlendMode mode = BlendMode::Over)
+        {
+            if(m_image == nullptr || overlay->getImage() == nullptr || m_channels != 4 || overlay->getChannels() != 4)
+            {
+                return; // TODO: Error-handling
+            }
+
+            blendRegion(overlay, nullptr, x, y, [mode](unsigned char* dst, const unsigned char* src, const unsigned char*, int pixels) {
+                blendRow(mode, dst, src, pixels);
+            });
+        }
+
+        // Blend an image with the same channel count onto the current one at (x, y), weighted by a one channel mask with the size of the overlay
+        void maskBlend(Image* overlay, Image* mask, int x, int y)
+        {
+            if(m_image == nullptr || overlay->getImage() == nullptr || mask->getImage() == nullptr ||
+               overlay->getChannels() != m_channels ||
+               mask->getChannels() != 1 ||
+               mask->getWidth() != overlay->getWidth() ||
+               mask->getHeight() != overlay->getHeight())
+            {
+                return; // TODO: Error-handling
+            }
+
+            int channels = m_channels;
+
+            blendRegion(overlay, mask, x, y, [channels](unsigned char* dst, const unsigned char* src, const unsigned char* mask_row, int pixels) {
+                maskBlendRow(dst, src, mask_row, pixels, channels);
+            });
+        }
+
+        // Blend a premultiplied rgba view onto the current image at (x, y)
+        void composite(const ImageView &overlay, int x, int y, BlendMode mode = BlendMode::Over)
+        {
+            Image source(overlay);
+            composite(&source, x, y, mode);
+        }
+
+        // Mask blend a view onto the current image at (x, y)
+        void maskBlend(const ImageView &overlay, const ImageView &mask, int x, int y)
+        {
+            Image source(overlay);
+            Image source_mask(mask);
+            maskBlend(&source, &source_mask, x, y);
+        }
+
+
+        // Write image to file, the format comes from options.format or else from the extension (JPEG if unknown). Returns false if encoding or writing failed
+        bool write(const char* path, WriteOptions options = WriteOptions())
+        {
+            options.format = options.format != ImageFormat::Auto ? options.format : formatFromPath(path);
+
+            if(options.format == ImageFormat::AfRaw)
+            {
+                return writeRaw(path);
+            }
+
+            if(options.format == ImageFormat::Ppm || options.format == ImageFormat::Pfm)
+            {
+                return writePnm(path, options.format == ImageFormat::Pfm ? 32 : options.pnm_bits);
+            }
+
+            BufferedWriter writer(path);
+            bool ok = write(&writer, options);
+            return writer.close() && ok;
+        }
+
+        // Encode the image into a buffered writer (a file descriptor, a pipe or memory), ImageFormat::Auto means JPEG
+        bool write(BufferedWriter* writer, WriteOptions options)
+        {
+            if(m_image == nullptr || writer == nullptr)
+            {
+                return false;
+            }
+
+            std::vector<unsigned char> buffer;
+            bool ok = false;
+
+            switch(options.format)
+            {
+                case ImageFormat::Auto:
+                case ImageFormat::Jpeg:
+                    return writeJpg(writer, options.jpeg_quality);
+                case ImageFormat::Png:
+                {
+                    PngOptions png;
+                    png.level = options.png_level;
+                    png.force_filter = options.png_filter;
+                    return writePng(writer, png);
+                }
+                case ImageFormat::Bmp:
+                    ok = stbi_write_bmp_to_func(BufferedWriter::callback, writer, m_width, m_height, m_channels, packedRows(buffer)) != 0;
+                    break;
+                case ImageFormat::Tga:
+                {
+                    // stb_image_write only has a global for this, so TGA writes are serialised while it is switched
+                    static std::mutex tga_mutex;
+                    std::lock_guard<std::mutex> lock(tga_mutex);
+                    int rle = stbi_write_tga_with_rle;
+                    stbi_write_tga_with_rle = options.tga_rle ? 1 : 0;
+                    ok = stbi_write_tga_to_func(BufferedWriter::callback, writer, m_width, m_height, m_channels, packedRows(buffer)) != 0;
+                    stbi_write_tga_with_rle = rle;
+                    break;
+                }
+                case ImageFormat::Ppm:
+                    ok = writePnm(writer, options.pnm_bits);
+                    break;
+                case ImageFormat::Pfm:
+                    ok = writePnm(writer, 32);
+                    break;
+                case ImageFormat::Qoi:
+                    return writeQoi(writer);
+                case ImageFormat::AfRaw:
+                {
+                    unsigned char head[AFRAW_DATA_OFFSET] = {};
+                    AfRawHeader header = makeAfRawHeader(m_width, m_height, m_channels, m_stride, ALIGNMENT);
+                    memcpy(head, &header, sizeof(header));
+                    writer->write(head, sizeof(head));
+                    writer->write(m_image, header.data_size);
+                    ok = true;
+                    break;
+                }
+            }
+
+            return ok && !writer->failed();
+        }
+
+        // Encode the image as binary PGM (1 or 2 channels) or PPM (3 or 4 channels) with 8 or 16 bits per sample, or as PFM (bits 32).
+        // Alpha is dropped.
+        bool writePnm(BufferedWriter* writer, int bits = 8)
+        {
+            if(m_image == nullptr || writer == nullptr)
+            {
+                return false;
+            }
+
+            bool ok = pnmWriteRows(view(), bits, m_thread_count, [writer](const unsigned char* data, size_t size) {
+                writer->write(data, size);
+                return !writer->failed();
+            });
+
+            return ok && !writer->failed();
+        }
+
+        // Encode the image as QOI (lossless, much faster than PNG) into a buffered writer, grey images are stored as RGB
+        bool writeQoi(BufferedWriter* writer)
+        {
+            if(m_image == nullptr || writer == nullptr)
+            {
+                return false;
+            }
+
+            return af::writeQoi(BufferedWriter::callback, writer, view()) && !writer->failed();
+        }
+
+        // Encode the image as JPEG into a buffered writer (a file descriptor, a pipe or memory), the strips of the image are encoded in parallel
+        bool writeJpg(BufferedWriter* writer, int quality = 100)
+        {
+            if(m_image == nullptr || writer == nullptr)
+            {
+                return false;
+            }
+
+            return writeJpegParallel(BufferedWriter::callback, writer, view(), quality, m_thread_count) && !writer->failed();
+        }
+
+        // Encode the image as PNG into a buffered writer, filtering and deflate run in parallel strips
+        bool writePng(BufferedWriter* writer, PngOptions options = PngOptions())
+        {
+            if(m_image == nullptr || writer == nullptr)
+            {
+                return false;
+            }
+
+            return writePngParallel(BufferedWriter::callback, writer, view(), options, m_thread_count) && !writer->failed();
         }
 
         // Delete the current image
@@ -381,11 +1704,11 @@ namespace af
         {
             if(m_image != nullptr)
             {
-                free(m_image);
-                m_image = nullptr;
+                releaseBuffer();
                 m_width = 0;
                 m_height = 0;
                 m_channels = 0;
+                m_stride = 0;
             }
         }
     };
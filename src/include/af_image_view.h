@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+
+namespace af
+{
+    // Non-owning window into 8-bit pixel memory, cropping only moves the pointer and keeps the stride of the underlying buffer
+    struct ImageView
+    {
+        unsigned char* data = nullptr;
+        int width = 0;
+        int height = 0;
+        int stride = 0;     // Bytes from the start of one row to the next
+        int channels = 0;
+
+        // Get the pointer to the first byte of a row
+        unsigned char* row(int row) const
+        {
+            return data + (ptrdiff_t)row * stride;
+        }
+
+        // Get the pointer to a pixel
+        unsigned char* pixel(int row, int col) const
+        {
+            return data + (ptrdiff_t)row * stride + (ptrdiff_t)col * channels;
+        }
+
+        // Sub-rectangle of the current view, clipped to its bounds
+        ImageView crop(int x, int y, int crop_width, int crop_height) const
+        {
+            int left = std::min(std::max(x, 0), width);
+            int top = std::min(std::max(y, 0), height);
+            int right = std::min(std::max(x + crop_width, left), width);
+            int bottom = std::min(std::max(y + crop_height, top), height);
+
+            return {pixel(top, left), right - left, bottom - top, stride, channels};
+        }
+
+        // True if the view points to pixels
+        bool valid() const
+        {
+            return data != nullptr && width > 0 && height > 0;
+        }
+
+        // True if the rows follow each other without a gap
+        bool contiguous() const
+        {
+            return stride == width * channels;
+        }
+    };
+
+    // Read-only counterpart of ImageView for pixels that must not be modified, every ImageView converts to it
+    struct ConstImageView
+    {
+        const unsigned char* data = nullptr;
+        int width = 0;
+        int height = 0;
+        int stride = 0;
+        int channels = 0;
+
+        ConstImageView() = default;
+
+        ConstImageView(const unsigned char* view_data, int view_width, int view_height, int view_stride, int view_channels)
+            : data(view_data), width(view_width), height(view_height), stride(view_stride), channels(view_channels)
+        {
+        }
+
+        ConstImageView(const ImageView &view)
+            : data(view.data), width(view.width), height(view.height), stride(view.stride), channels(view.channels)
+        {
+        }
+
+        // Get the pointer to the first byte of a row
+        const unsigned char* row(int row) const
+        {
+            return data + (ptrdiff_t)row * stride;
+        }
+
+        // Get the pointer to a pixel
+        const unsigned char* pixel(int row, int col) const
+        {
+            return data + (ptrdiff_t)row * stride + (ptrdiff_t)col * channels;
+        }
+
+        // Sub-rectangle of the current view, clipped to its bounds
+        ConstImageView crop(int x, int y, int crop_width, int crop_height) const
+        {
+            int left = std::min(std::max(x, 0), width);
+            int top = std::min(std::max(y, 0), height);
+            int right = std::min(std::max(x + crop_width, left), width);
+            int bottom = std::min(std::max(y + crop_height, top), height);
+
+            return {pixel(top, left), right - left, bottom - top, stride, channels};
+        }
+
+        // True if the view points to pixels
+        bool valid() const
+        {
+            return data != nullptr && width > 0 && height > 0;
+        }
+
+        // True if the rows follow each other without a gap
+        bool contiguous() const
+        {
+            return stride == width * channels;
+        }
+    };
+};
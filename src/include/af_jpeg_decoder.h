@@ -0,0 +1,872 @@
+#pragma once
+
+// Needs the stb_image implementation in the same translation unit (included by af_image_threads.h before this header)
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <climits>
+
+#include "af_rolling_kernel.h"
+
+
+namespace af
+{
+    // State of a JPEG decode that the IDCT kernel needs: stb calls it with only the output pointer, so it is handed over per thread
+    struct JpegDecodeContext
+    {
+        stbi__jpeg* jpeg = nullptr;
+        int scale = 1;                                                          // 1, 2, 4 or 8
+        void (*idct)(stbi_uc* out, int out_stride, short data[64]) = nullptr;   // The full 8x8 kernel stb picked
+    };
+
+    inline JpegDecodeContext*& jpegDecodeContext()
+    {
+        thread_local JpegDecodeContext* context = nullptr;
+        return context;
+    }
+
+    // One component plane after decoding, at the output scale
+    struct JpegPlane
+    {
+        stbi_uc* data = nullptr;
+        int stride = 0;
+        int width = 0;
+        int height = 0;
+        int ring_rows = 0;      // Rows held if data is a ring buffer that row i wraps around in, 0 if it holds the whole plane
+
+        stbi_uc* row(int index) const
+        {
+            return data + (size_t)(ring_rows > 0 ? index % ring_rows : index) * stride;
+        }
+    };
+
+    // Reduced IDCT: the top-left size x size coefficients of a dequantized block through a size-point IDCT, which gives the block
+    // downscaled by 8 / size. size 1 is the DC coefficient alone (the block average).
+    inline void jpegReducedIdct(stbi_uc* out, int out_stride, const short data[64], int size)
+    {
+        if(size == 1)
+        {
+            int value = (data[0] + 1028) >> 3;     // DC / 8 + 128, rounded
+            out[0] = (stbi_uc)(value < 0 ? 0 : (value > 255 ? 255 : value));
+            return;
+        }
+
+        // cosines[size][x][u] = C(u) / 2 * cos((2x + 1) * u * pi / (2 * size)), the 8-point normalization so the DC gain stays 1/8
+        static const std::vector<float> cosines = []() {
+            std::vector<float> table(3 * 16);
+
+            for(int k = 2, t = 0; k <= 4; k *= 2, t++)
+            {
+                for(int x = 0; x < k; x++)
+                {
+                    for(int u = 0; u < k; u++)
+                    {
+                        float c = u == 0 ? 0.70710678f : 1.0f;
+                        table[t * 16 + x * 4 + u] = 0.5f * c * cosf((2 * x + 1) * u * 3.14159265f / (2 * k));
+                    }
+                }
+            }
+
+            return table;
+        }();
+
+        const float* table = cosines.data() + (size == 2 ? 0 : 16);
+        float rows[4][4];
+
+        for(int v = 0; v < size; v++)
+        {
+            for(int x = 0; x < size; x++)
+            {
+                float sum = 0;
+
+                for(int u = 0; u < size; u++)
+                {
+                    sum += table[x * 4 + u] * data[v * 8 + u];
+                }
+
+                rows[v][x] = sum;
+            }
+        }
+
+        for(int y = 0; y < size; y++)
+        {
+            for(int x = 0; x < size; x++)
+            {
+                float sum = 128.5f;
+
+                for(int v = 0; v < size; v++)
+                {
+                    sum += table[y * 4 + v] * rows[v][x];
+                }
+
+                out[y * out_stride + x] = (stbi_uc)(sum < 0 ? 0 : (sum > 255 ? 255 : (int)sum));
+            }
+        }
+    }
+
+    // IDCT kernel installed into stbi__jpeg: finds the component and block from the output pointer and writes the block at the
+    // output scale, packed at the start of the component buffer with a stride of w2 / scale (the buffer is only written, never read)
+    inline void jpegScaledIdct(stbi_uc* out, int out_stride, short data[64])
+    {
+        JpegDecodeContext* context = jpegDecodeContext();
+        stbi__jpeg* z = context->jpeg;
+
+        for(int n = 0; n < z->s->img_n; n++)
+        {
+            stbi_uc* plane = z->img_comp[n].data;
+            int w2 = z->img_comp[n].w2;
+
+            if(out < plane || out >= plane + (size_t)w2 * z->img_comp[n].h2)
+            {
+                continue;
+            }
+
+            size_t offset = out - plane;
+            int size = 8 / context->scale;
+            int stride = w2 / context->scale;
+            stbi_uc* dst = plane + (offset / w2 / 8 * size) * stride + (offset % w2) / 8 * size;
+
+            if(size == 8)
+            {
+                context->idct(dst, stride, data);
+            }
+            else
+            {
+                jpegReducedIdct(dst, stride, data, size);
+            }
+
+            return;
+        }
+
+        context->idct(out, out_stride, data);
+    }
+
+    // Upsampling and color conversion of decoded JPEG planes to interleaved rows, one output row per call and top to bottom.
+    // Mirrors the end of stb's load_jpeg_image, for 1 (grey) or 3 (RGB) output channels. A plane may be a ring buffer as long as
+    // the rows around the current one are still in it.
+    class JpegRowConverter
+    {
+    private:
+        stbi__jpeg* m_jpeg = nullptr;
+        JpegPlane m_planes[4];
+        stbi__resample m_resample[4];
+        std::vector<stbi_uc> m_lines[4];
+        int m_width = 0;
+        int m_channels = 0;
+        int m_decode_n = 0;
+        bool m_is_rgb = false;
+
+    public:
+        // planes hold the components at the output size (width x height of the whole image)
+        JpegRowConverter(stbi__jpeg* z, const JpegPlane planes[4], int width)
+        {
+            m_jpeg = z;
+            m_width = width;
+            m_channels = z->s->img_n >= 3 ? 3 : 1;
+            m_is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+            m_decode_n = z->s->img_n;
+
+            for(int k = 0; k < m_decode_n; k++)
+            {
+                stbi__resample* r = &m_resample[k];
+                m_planes[k] = planes[k];
+                m_lines[k].resize(width + 3);
+
+                r->hs = z->img_h_max / z->img_comp[k].h;
+                r->vs = z->img_v_max / z->img_comp[k].v;
+                r->ystep = r->vs >> 1;
+                r->w_lores = (width + r->hs - 1) / r->hs;
+                r->ypos = 0;
+                r->line0 = r->line1 = planes[k].row(0);
+
+                if(r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+                else if(r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+                else if(r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+                else if(r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+                else r->resample = stbi__resample_row_generic;
+            }
+        }
+
+        int channels() const
+        {
+            return m_channels;
+        }
+
+        // Produce the next row, or the count pixels of it from column x (count -1 = to the end of the row), count * channels() bytes
+        // plus one the color kernels may overwrite. With out nullptr the row is skipped without upsampling or converting it.
+        void convertRow(stbi_uc* out, int x = 0, int count = -1)
+        {
+            stbi__jpeg* z = m_jpeg;
+            stbi_uc* rows[4] = {nullptr, nullptr, nullptr, nullptr};
+
+            for(int k = 0; k < m_decode_n; k++)
+            {
+                stbi__resample* r = &m_resample[k];
+                int y_bot = r->ystep >= (r->vs >> 1);
+
+                if(out != nullptr)
+                {
+                    rows[k] = r->resample(m_lines[k].data(), y_bot ? r->line1 : r->line0, y_bot ? r->line0 : r->line1, r->w_lores, r->hs) + x;
+                }
+
+                if(++r->ystep >= r->vs)
+                {
+                    r->ystep = 0;
+                    r->line0 = r->line1;
+
+                    if(++r->ypos < m_planes[k].height)
+                    {
+                        r->line1 = m_planes[k].row(r->ypos);
+                    }
+                }
+            }
+
+            if(out == nullptr)
+            {
+                return;
+            }
+
+            int width = count < 0 ? m_width - x : count;
+
+            if(m_channels == 1)
+            {
+                memcpy(out, rows[0], width);
+                return;
+            }
+
+            if(z->s->img_n == 3 && m_is_rgb)
+            {
+                for(int i = 0; i < width; i++, out += 3)
+                {
+                    out[0] = rows[0][i];
+                    out[1] = rows[1][i];
+                    out[2] = rows[2][i];
+                }
+            }
+            else if(z->s->img_n == 4 && z->app14_color_transform == 0)     // CMYK
+            {
+                for(int i = 0; i < width; i++, out += 3)
+                {
+                    out[0] = stbi__blinn_8x8(rows[0][i], rows[3][i]);
+                    out[1] = stbi__blinn_8x8(rows[1][i], rows[3][i]);
+                    out[2] = stbi__blinn_8x8(rows[2][i], rows[3][i]);
+                }
+            }
+            else if(z->s->img_n == 4 && z->app14_color_transform == 2)     // YCCK
+            {
+                z->YCbCr_to_RGB_kernel(out, rows[0], rows[1], rows[2], width, 3);
+
+                for(int i = 0; i < width; i++, out += 3)
+                {
+                    out[0] = stbi__blinn_8x8(255 - out[0], rows[3][i]);
+                    out[1] = stbi__blinn_8x8(255 - out[1], rows[3][i]);
+                    out[2] = stbi__blinn_8x8(255 - out[2], rows[3][i]);
+                }
+            }
+            else
+            {
+                z->YCbCr_to_RGB_kernel(out, rows[0], rows[1], rows[2], width, 3);
+            }
+        }
+    };
+
+    // Decode a JPEG at 1/scale of its size (scale 1, 2, 4 or 8, dimensions rounded up). The IDCT only produces the pixels of the
+    // smaller image, and upsampling and color conversion run at that size, so a 1/8 decode is mostly entropy decoding.
+    // Returns a buffer to free with stbi_image_free, nullptr if the data is not a JPEG stb can decode.
+    inline unsigned char* jpegDecodeScaled(stbi__context* s, int scale, int* width, int* height, int* channels)
+    {
+        if(scale != 1 && scale != 2 && scale != 4 && scale != 8)
+        {
+            return nullptr;
+        }
+
+        stbi__jpeg* z = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+
+        if(z == nullptr)
+        {
+            return nullptr;
+        }
+
+        z->s = s;
+        z->s->img_n = 0;    // Makes stbi__cleanup_jpeg safe
+        stbi__setup_jpeg(z);
+
+        JpegDecodeContext context;
+        context.jpeg = z;
+        context.scale = scale;
+        context.idct = z->idct_block_kernel;
+        z->idct_block_kernel = jpegScaledIdct;
+
+        JpegDecodeContext* previous = jpegDecodeContext();
+        jpegDecodeContext() = &context;
+        bool ok = stbi__decode_jpeg_image(z) != 0;
+        jpegDecodeContext() = previous;
+
+        unsigned char* output = nullptr;
+
+        if(ok && (z->s->img_n == 1 || z->s->img_n == 3 || z->s->img_n == 4))
+        {
+            int out_width = (z->s->img_x + scale - 1) / scale;
+            int out_height = (z->s->img_y + scale - 1) / scale;
+            JpegPlane planes[4];
+
+            for(int n = 0; n < z->s->img_n; n++)
+            {
+                planes[n].data = z->img_comp[n].data;
+                planes[n].stride = z->img_comp[n].w2 / scale;
+                planes[n].width = (z->img_comp[n].x + scale - 1) / scale;
+                planes[n].height = (z->img_comp[n].y + scale - 1) / scale;
+            }
+
+            JpegRowConverter converter(z, planes, out_width);
+            output = (unsigned char*)stbi__malloc_mad3(converter.channels(), out_width, out_height, 1);     // The color kernels write one byte past the last pixel
+
+            if(output != nullptr)
+            {
+                for(int row = 0; row < out_height; row++)
+                {
+                    converter.convertRow(output + (size_t)row * out_width * converter.channels());
+                }
+
+                *width = out_width;
+                *height = out_height;
+                *channels = converter.channels();
+            }
+        }
+
+        stbi__cleanup_jpeg(z);
+        STBI_FREE(z);
+        return output;
+    }
+
+    // Scaled decode of a JPEG in memory
+    inline unsigned char* jpegDecodeScaledFromMemory(const unsigned char* data, size_t size, int scale, int* width, int* height, int* channels)
+    {
+        if(data == nullptr || size == 0 || size > (size_t)INT_MAX)
+        {
+            return nullptr;
+        }
+
+        stbi__context s;
+        stbi__start_mem(&s, data, (int)size);
+        return jpegDecodeScaled(&s, scale, width, height, channels);
+    }
+
+    // Scaled decode of a JPEG file
+    inline unsigned char* jpegDecodeScaledFromFile(const char* path, int scale, int* width, int* height, int* channels)
+    {
+        FILE* file = path != nullptr ? fopen(path, "rb") : nullptr;
+
+        if(file == nullptr)
+        {
+            return nullptr;
+        }
+
+        stbi__context s;
+        stbi__start_file(&s, file);
+        unsigned char* decoded = jpegDecodeScaled(&s, scale, width, height, channels);
+        fclose(file);
+        return decoded;
+    }
+
+    // Part of a JPEG to decode, a width or height of 0 extends to the right or bottom edge
+    struct JpegRegion
+    {
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+    };
+
+    // Rows delivered by a streaming decode: count rows of the region starting at image row `row`, region.width * channels bytes each
+    struct JpegRowBatch
+    {
+        int row = 0;
+        int count = 0;
+        const unsigned char* data = nullptr;
+        int stride = 0;
+        int channels = 0;
+        JpegRegion region;      // Clamped to the image
+    };
+
+    using JpegRowsCallback = std::function<void(const JpegRowBatch &batch)>;
+
+    struct JpegStreamStats
+    {
+        bool ok = false;
+        int width = 0;              // Whole image
+        int height = 0;
+        int channels = 0;           // 1 (grey) or 3 (RGB)
+        JpegRegion region;          // Clamped to the image
+        bool streamed = false;      // Decoded band by band. Progressive and multi-scan files are decoded whole before the rows are delivered.
+        bool stopped_early = false; // Entropy decoding stopped after the last band the region needs
+        size_t buffer_bytes = 0;    // Ring buffers and batch (streamed) or the decoded planes
+    };
+
+    // Row-streaming JPEG decode. stb parses the markers and headers, but the MCU loop of a baseline scan with every component is run
+    // here: the blocks go into ring buffers of three bands (MCU rows) per component, and every time a band starts, the band two before
+    // it is complete together with the one below it that upsampling reads, so its rows are upsampled, color converted and handed to
+    // the callback. Blocks outside the region (plus a margin for the upsampling filter) are entropy decoded but not transformed, rows
+    // above it are not converted, and the MCU loop returns after the band below the region. Progressive and multi-scan files go
+    // through stb's own loop and are converted once they are complete.
+    // stb still allocates the full component buffers, but the streamed decode never touches them, so their pages are not committed.
+    class JpegRowStream
+    {
+    private:
+        stbi__jpeg* m_jpeg;
+        JpegRegion m_region;
+        int m_batch_rows;
+        const JpegRowsCallback &m_callback;
+
+        bool m_started = false;
+        bool m_streaming = false;
+        bool m_done = false;                // The region is complete, decoding stopped on purpose
+        std::vector<stbi_uc> m_rings[4];
+        JpegPlane m_planes[4];
+        int m_band_rows[4] = {8, 8, 8, 8};  // Rows of a component plane per band
+        int m_band_height = 8;              // Image rows per band
+        std::unique_ptr<JpegRowConverter> m_converter;
+        std::vector<unsigned char> m_batch;
+        int m_batch_count = 0;
+        int m_batch_row = 0;                // Image row of the first row in the batch
+        int m_next_row = 0;                 // Next image row to convert or skip
+
+        // Set up at the first scan, when the frame and the scan header are known
+        void start()
+        {
+            stbi__jpeg* z = m_jpeg;
+            m_started = true;
+            m_streaming = !z->progressive && z->scan_n == z->s->img_n;
+
+            int width = z->s->img_x;
+            int height = z->s->img_y;
+            m_region.x = std::min(std::max(m_region.x, 0), width);
+            m_region.y = std::min(std::max(m_region.y, 0), height);
+            m_region.width = m_region.width > 0 ? std::min(m_region.width, width - m_region.x) : width - m_region.x;
+            m_region.height = m_region.height > 0 ? std::min(m_region.height, height - m_region.y) : height - m_region.y;
+
+            int channels = z->s->img_n >= 3 ? 3 : 1;
+            m_batch.resize((size_t)m_batch_rows * m_region.width * channels + 1);   // The color kernels write one byte past the row
+
+            if(!m_streaming)
+            {
+                return;
+            }
+
+            for(int n = 0; n < z->s->img_n; n++)
+            {
+                m_band_rows[n] = z->scan_n == 1 ? 8 : 8 * z->img_comp[n].v;
+                m_rings[n].resize((size_t)3 * m_band_rows[n] * z->img_comp[n].w2);
+                m_planes[n].data = m_rings[n].data();
+                m_planes[n].stride = z->img_comp[n].w2;
+                m_planes[n].width = z->img_comp[n].x;
+                m_planes[n].height = z->img_comp[n].y;
+                m_planes[n].ring_rows = 3 * m_band_rows[n];
+            }
+
+            m_band_height = m_band_rows[0] * (z->img_v_max / z->img_comp[0].v);
+            m_converter.reset(new JpegRowConverter(z, m_planes, width));
+        }
+
+        void flushBatch()
+        {
+            if(m_batch_count == 0)
+            {
+                return;
+            }
+
+            JpegRowBatch batch;
+            batch.row = m_batch_row;
+            batch.count = m_batch_count;
+            batch.data = m_batch.data();
+            batch.stride = m_region.width * m_converter->channels();
+            batch.channels = m_converter->channels();
+            batch.region = m_region;
+            m_callback(batch);
+            m_batch_count = 0;
+        }
+
+        // Convert the image rows up to (not including) end that are not done yet
+        void emitRows(int end)
+        {
+            int stride = m_region.width * m_converter->channels();
+            end = std::min(end, m_region.y + m_region.height);
+
+            for(; m_next_row < end; m_next_row++)
+            {
+                if(m_next_row < m_region.y)
+                {
+                    m_converter->convertRow(nullptr);
+                    continue;
+                }
+
+                if(m_batch_count == 0)
+                {
+                    m_batch_row = m_next_row;
+                }
+
+                m_converter->convertRow(m_batch.data() + (size_t)m_batch_count * stride, m_region.x, m_region.width);
+
+                if(++m_batch_count == m_batch_rows)
+                {
+                    flushBatch();
+                }
+            }
+
+            if(m_next_row == m_region.y + m_region.height)
+            {
+                flushBatch();
+            }
+        }
+
+        // A band starts: deliver the rows that are complete now, false once the region is done and the MCU loop can stop
+        bool beginBand(int band)
+        {
+            emitRows((band - 1) * m_band_height);
+            m_done = m_next_row >= m_region.y + m_region.height;
+            return !m_done;
+        }
+
+        // Transform a decoded block of component n at (plane_row, plane_col) into its ring buffer, unless the region does not need it
+        void block(int n, int plane_row, int plane_col, short data[64])
+        {
+            stbi__jpeg* z = m_jpeg;
+            int band = plane_row / m_band_rows[n];
+            int hs = z->img_h_max / z->img_comp[n].h;
+            int margin = 16;
+
+            if((band + 1) * m_band_height <= m_region.y - m_band_height || band * m_band_height >= m_region.y + m_region.height + m_band_height ||
+               (plane_col + 8) * hs <= m_region.x - margin || plane_col * hs >= m_region.x + m_region.width + margin)
+            {
+                return;     // Not needed for the region
+            }
+
+            z->idct_block_kernel(m_planes[n].row(plane_row) + plane_col, m_planes[n].stride, data);
+        }
+
+        // Count down the restart interval after an MCU, false if a restart marker is missing (stb keeps what was decoded so far)
+        bool nextMcu()
+        {
+            stbi__jpeg* z = m_jpeg;
+
+            if(--z->todo <= 0)
+            {
+                if(z->code_bits < 24)
+                {
+                    stbi__grow_buffer_unsafe(z);
+                }
+
+                if(!STBI__RESTART(z->marker))
+                {
+                    return false;
+                }
+
+                stbi__jpeg_reset(z);
+            }
+
+            return true;
+        }
+
+        // stb's baseline MCU loop (stbi__parse_entropy_coded_data), returns after the band below the region, false on corrupt data
+        bool decodeScan()
+        {
+            stbi__jpeg* z = m_jpeg;
+            STBI_SIMD_ALIGN(short, data[64]);
+            stbi__jpeg_reset(z);
+
+            if(z->scan_n == 1)
+            {
+                // Grey: every block is an MCU, a band is one row of blocks
+                int n = z->order[0];
+                int ha = z->img_comp[n].ha;
+                int blocks_x = (z->img_comp[n].x + 7) >> 3;
+                int blocks_y = (z->img_comp[n].y + 7) >> 3;
+
+                for(int j = 0; j < blocks_y && beginBand(j); j++)
+                {
+                    for(int i = 0; i < blocks_x; i++)
+                    {
+                        if(!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq]))
+                        {
+                            return false;
+                        }
+
+                        block(n, j * 8, i * 8, data);
+
+                        if(!nextMcu())
+                        {
+                            return true;
+                        }
+                    }
+                }
+
+                return true;
+            }
+
+            for(int j = 0; j < z->img_mcu_y && beginBand(j); j++)
+            {
+                for(int i = 0; i < z->img_mcu_x; i++)
+                {
+                    for(int k = 0; k < z->scan_n; k++)
+                    {
+                        int n = z->order[k];
+                        int ha = z->img_comp[n].ha;
+
+                        for(int y = 0; y < z->img_comp[n].v; y++)
+                        {
+                            for(int x = 0; x < z->img_comp[n].h; x++)
+                            {
+                                if(!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq]))
+                                {
+                                    return false;
+                                }
+
+                                block(n, (j * z->img_comp[n].v + y) * 8, (i * z->img_comp[n].h + x) * 8, data);
+                            }
+                        }
+                    }
+
+                    if(!nextMcu())
+                    {
+                        return true;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+    public:
+        JpegRowStream(stbi__jpeg* z, const JpegRegion &region, int batch_rows, const JpegRowsCallback &callback) : m_callback(callback)
+        {
+            m_jpeg = z;
+            m_region = region;
+            m_batch_rows = std::max(1, batch_rows);
+        }
+
+        // The marker loop of stbi__decode_jpeg_image with the first scan decoded by decodeScan() if it can be streamed. Returns true
+        // once the image is decoded or the region is complete (m_done), false on corrupt data.
+        bool decode()
+        {
+            stbi__jpeg* z = m_jpeg;
+
+            for(int n = 0; n < 4; n++)
+            {
+                z->img_comp[n].raw_data = nullptr;
+                z->img_comp[n].raw_coeff = nullptr;
+            }
+
+            z->restart_interval = 0;
+
+            if(!stbi__decode_jpeg_header(z, STBI__SCAN_load))
+            {
+                return false;
+            }
+
+            int marker = stbi__get_marker(z);
+
+            while(!stbi__EOI(marker))
+            {
+                if(stbi__SOS(marker))
+                {
+                    bool first = !m_started;
+
+                    if(!stbi__process_scan_header(z))
+                    {
+                        return false;
+                    }
+
+                    if(first)
+                    {
+                        start();
+                    }
+
+                    if(first && m_streaming)
+                    {
+                        if(!decodeScan())
+                        {
+                            return false;
+                        }
+
+                        if(m_done)
+                        {
+                            return true;
+                        }
+                    }
+                    else if(!stbi__parse_entropy_coded_data(z))
+                    {
+                        return false;
+                    }
+
+                    if(z->marker == STBI__MARKER_none)
+                    {
+                        // Skip junk up to the next marker like stb does
+                        while(!stbi__at_eof(z->s))
+                        {
+                            if(stbi__get8(z->s) == 255)
+                            {
+                                z->marker = stbi__get8(z->s);
+                                break;
+                            }
+                        }
+                    }
+                }
+                else if(stbi__DNL(marker))
+                {
+                    int length = stbi__get16be(z->s);
+                    stbi__uint32 lines = stbi__get16be(z->s);
+
+                    if(length != 4 || lines != z->s->img_y)
+                    {
+                        return false;
+                    }
+                }
+                else if(!stbi__process_marker(z, marker))
+                {
+                    return false;
+                }
+
+                marker = stbi__get_marker(z);
+            }
+
+            if(z->progressive)
+            {
+                stbi__jpeg_finish(z);
+            }
+
+            return true;
+        }
+
+        // Deliver the remaining rows once decode() succeeded, the whole image if it could not be streamed
+        JpegStreamStats finish()
+        {
+            stbi__jpeg* z = m_jpeg;
+            JpegStreamStats stats;
+
+            if(!m_started)
+            {
+                return stats;
+            }
+
+            if(!m_streaming)
+            {
+                for(int n = 0; n < z->s->img_n; n++)
+                {
+                    m_planes[n].data = z->img_comp[n].data;
+                    m_planes[n].stride = z->img_comp[n].w2;
+                    m_planes[n].width = z->img_comp[n].x;
+                    m_planes[n].height = z->img_comp[n].y;
+                    stats.buffer_bytes += (size_t)z->img_comp[n].w2 * z->img_comp[n].h2;
+                }
+
+                m_converter.reset(new JpegRowConverter(z, m_planes, z->s->img_x));
+            }
+
+            emitRows(z->s->img_y);
+
+            for(int n = 0; n < z->s->img_n; n++)
+            {
+                stats.buffer_bytes += m_rings[n].size();
+            }
+
+            stats.ok = true;
+            stats.width = z->s->img_x;
+            stats.height = z->s->img_y;
+            stats.channels = m_converter->channels();
+            stats.region = m_region;
+            stats.streamed = m_streaming;
+            stats.stopped_early = m_done;
+            stats.buffer_bytes += m_batch.size();
+            return stats;
+        }
+    };
+
+    // Decode a JPEG and hand its rows (or the rows of a region) to callback in batches of batch_rows, top to bottom, without holding
+    // the decoded image: peak memory is three MCU rows per component plus the batch. The pixels are the ones stbi_load gives.
+    inline JpegStreamStats jpegDecodeRows(stbi__context* s, const JpegRegion &region, int batch_rows, const JpegRowsCallback &callback)
+    {
+        stbi__jpeg* z = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+
+        if(z == nullptr)
+        {
+            return JpegStreamStats();
+        }
+
+        z->s = s;
+        z->s->img_n = 0;    // Makes stbi__cleanup_jpeg safe
+        stbi__setup_jpeg(z);
+
+        JpegRowStream stream(z, region, batch_rows, callback);
+        bool decoded = stream.decode() && (z->s->img_n == 1 || z->s->img_n == 3 || z->s->img_n == 4);
+        JpegStreamStats stats = decoded ? stream.finish() : JpegStreamStats();
+
+        stbi__cleanup_jpeg(z);
+        STBI_FREE(z);
+        return stats;
+    }
+
+    // Streaming decode of a JPEG in memory
+    inline JpegStreamStats jpegDecodeRowsFromMemory(const unsigned char* data, size_t size, const JpegRegion &region, int batch_rows,
+                                                    const JpegRowsCallback &callback)
+    {
+        if(data == nullptr || size == 0 || size > (size_t)INT_MAX)
+        {
+            return JpegStreamStats();
+        }
+
+        stbi__context s;
+        stbi__start_mem(&s, data, (int)size);
+        return jpegDecodeRows(&s, region, batch_rows, callback);
+    }
+
+    // Streaming decode of a JPEG file, read through stdio as the decoder goes
+    inline JpegStreamStats jpegDecodeRowsFromFile(const char* path, const JpegRegion &region, int batch_rows, const JpegRowsCallback &callback)
+    {
+        FILE* file = path != nullptr ? fopen(path, "rb") : nullptr;
+
+        if(file == nullptr)
+        {
+            return JpegStreamStats();
+        }
+
+        stbi__context s;
+        stbi__start_file(&s, file);
+        JpegStreamStats stats = jpegDecodeRows(&s, region, batch_rows, callback);
+        fclose(file);
+        return stats;
+    }
+
+    // Decode a JPEG (or a region of it) straight into a rolling convolution: the rows go from the decoder to the kernel and out to
+    // the sink one band at a time, neither the decoded nor the filtered image is ever held. Sink rows are numbered from the region top.
+    inline JpegStreamStats convolveJpegRows(const char* path, const std::vector<std::vector<float>> &kernel, const RowSink &sink,
+                                            const JpegRegion &region = JpegRegion(), const PointOps* point_ops = nullptr)
+    {
+        std::unique_ptr<RollingConvolver> convolver;
+
+        JpegStreamStats stats = jpegDecodeRowsFromFile(path, region, 16, [&](const JpegRowBatch &batch) {
+            if(!convolver)
+            {
+                convolver.reset(new RollingConvolver(kernel, batch.region.width, batch.region.height, batch.channels, sink, point_ops));
+            }
+
+            for(int i = 0; i < batch.count; i++)
+            {
+                convolver->pushRow(batch.data + (size_t)i * batch.stride);
+            }
+        });
+
+        if(convolver)
+        {
+            convolver->finish();
+            stats.buffer_bytes += convolver->bufferBytes();
+        }
+
+        return stats;
+    }
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+// Needs the stb_image_write implementation in the same translation unit (included by af_image_threads.h before this header)
+
+#include <vector>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "af_image_view.h"
+#include "af_parallel.h"
+
+
+namespace af
+{
+    // Tables of the stb_image_write JPEG encoder for one quality setting, read back from the headers it writes
+    struct JpegTables
+    {
+        std::vector<unsigned char> header;      // SOI up to and including SOS, with the dimensions of a 1x1 image
+        size_t sof_offset = 0;                  // Offset of the SOF0 marker in header
+        size_t sos_offset = 0;                  // Offset of the SOS marker in header
+        bool subsample = false;                 // 4:2:0 (16x16 MCUs) or 4:4:4 (8x8 MCUs)
+        float fdtbl_y[64];
+        float fdtbl_uv[64];
+        unsigned short ydc[256][2];             // {code, length} as stbiw__jpg_writeBits takes them
+        unsigned short uvdc[256][2];
+        unsigned short yac[256][2];
+        unsigned short uvac[256][2];
+    };
+
+    // stbi_write_func appending to a std::vector<unsigned char>
+    inline void appendToVector(void* context, void* data, int size)
+    {
+        std::vector<unsigned char>* out = (std::vector<unsigned char>*)context;
+        out->insert(out->end(), (unsigned char*)data, (unsigned char*)data + size);
+    }
+
+    // Build the canonical Huffman codes of a DHT table (16 code counts followed by the values)
+    inline void jpegHuffmanCodes(const unsigned char* counts, const unsigned char* values, unsigned short table[256][2])
+    {
+        memset(table, 0, sizeof(unsigned short) * 256 * 2);
+        int code = 0;
+
+        for(int length = 1, k = 0; length <= 16; length++, code <<= 1)
+        {
+            for(int i = 0; i < counts[length - 1]; i++, k++, code++)
+            {
+                table[values[k]][0] = (unsigned short)code;
+                table[values[k]][1] = (unsigned short)length;
+            }
+        }
+    }
+
+    // Get the tables stb_image_write uses for a quality, by encoding a 1x1 image and parsing its header. Returns false if the header is not understood.
+    inline bool jpegTables(int quality, JpegTables &tables)
+    {
+        static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+                                      1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+
+        std::vector<unsigned char> jpeg;
+        unsigned char pixel[3] = {0, 0, 0};
+
+        if(!stbi_write_jpg_to_func(appendToVector, &jpeg, 1, 1, 3, pixel, quality))
+        {
+            return false;
+        }
+
+        const unsigned char* qt[2] = {nullptr, nullptr};
+        size_t pos = 2;
+
+        // Walk the marker segments up to SOS
+        while(pos + 4 <= jpeg.size() && jpeg.at(pos) == 0xFF)
+        {
+            unsigned char marker = jpeg.at(pos + 1);
+            size_t length = ((size_t)jpeg.at(pos + 2) << 8) | jpeg.at(pos + 3);
+            const unsigned char* segment = jpeg.data() + pos + 4;
+            const unsigned char* end = jpeg.data() + pos + 2 + length;
+
+            if(pos + 2 + length > jpeg.size())
+            {
+                return false;
+            }
+
+            if(marker == 0xDB)          // DQT: (id, 64 values) pairs
+            {
+                for(const unsigned char* p = segment; p + 65 <= end; p += 65)
+                {
+                    qt[*p & 1] = p + 1;
+                }
+            }
+            else if(marker == 0xC0)     // SOF0: the luma sampling factors tell the MCU size
+            {
+                tables.sof_offset = pos;
+                tables.subsample = segment[7] == 0x22;
+            }
+            else if(marker == 0xC4)     // DHT: (class/id, 16 counts, values) tables
+            {
+                for(const unsigned char* p = segment; p + 17 <= end;)
+                {
+                    int total = 0;
+
+                    for(int i = 1; i <= 16; i++)
+                    {
+                        total += p[i];
+                    }
+
+                    unsigned short (*table)[2] = (*p >> 4) == 0 ? ((*p & 1) ? tables.uvdc : tables.ydc) : ((*p & 1) ? tables.uvac : tables.yac);
+                    jpegHuffmanCodes(p + 1, p + 17, table);
+                    p += 17 + total;
+                }
+            }
+            else if(marker == 0xDA)     // SOS: the entropy-coded data follows
+            {
+                tables.sos_offset = pos;
+                tables.header.assign(jpeg.begin(), jpeg.begin() + pos + 2 + length);
+                break;
+            }
+
+            pos += 2 + length;
+        }
+
+        if(tables.header.empty() || tables.sof_offset == 0 || qt[0] == nullptr || qt[1] == nullptr)
+        {
+            return false;
+        }
+
+        // Same expressions as stbi_write_jpg_core, so the quantization is bit-identical
+        for(int row = 0, k = 0; row < 8; ++row)
+        {
+            for(int col = 0; col < 8; ++col, ++k)
+            {
+                tables.fdtbl_y[k] = 1 / (qt[0][stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+                tables.fdtbl_uv[k] = 1 / (qt[1][stbiw__jpg_ZigZag[k]] * aasf[row] * aasf[col]);
+            }
+        }
+
+        return true;
+    }
+
+    // Entropy-code the MCU rows [first_mcu_row, end_mcu_row) of an image into out, starting with fresh DC predictors (a restart interval).
+    // The color conversion, DCT and quantization are the ones of stbi_write_jpg_core.
+    inline void jpegEncodeMcuRows(const JpegTables &tables, const ImageView &view, int first_mcu_row, int end_mcu_row, std::vector<unsigned char> &out)
+    {
+        static const unsigned short fill_bits[] = {0x7F, 7};
+
+        stbi__write_context s = {};
+        stbi__start_write_callbacks(&s, appendToVector, &out);
+
+        int width = view.width;
+        int height = view.height;
+        int comp = view.channels;
+        int mcu_size = tables.subsample ? 16 : 8;
+        int DCY = 0, DCU = 0, DCV = 0;
+        int bitBuf = 0, bitCnt = 0;
+        int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;    // comp == 2 is grey+alpha (alpha is ignored)
+        float Y[256], U[256], V[256];
+
+        for(int y = first_mcu_row * mcu_size; y < end_mcu_row * mcu_size; y += mcu_size)
+        {
+            for(int x = 0; x < width; x += mcu_size)
+            {
+                int pos = 0;
+
+                for(int row = y; row < y + mcu_size; ++row)
+                {
+                    // row >= height => use last input row, col >= width => use pixel from last input column
+                    int clamped_row = (row < height) ? row : height - 1;
+                    const unsigned char* data = view.row(stbi__flip_vertically_on_write ? (height - 1 - clamped_row) : clamped_row);
+
+                    for(int col = x; col < x + mcu_size; ++col, ++pos)
+                    {
+                        const unsigned char* p = data + ((col < width) ? col : (width - 1)) * comp;
+                        float r = p[0], g = p[ofsG], b = p[ofsB];
+                        Y[pos] = +0.29900f * r + 0.58700f * g + 0.11400f * b - 128;
+                        U[pos] = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+                        V[pos] = +0.50000f * r - 0.41869f * g - 0.08131f * b;
+                    }
+                }
+
+                float* fdtbl_y = (float*)tables.fdtbl_y;
+                float* fdtbl_uv = (float*)tables.fdtbl_uv;
+
+                if(tables.subsample)
+                {
+                    float subU[64], subV[64];
+
+                    DCY = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, Y + 0, 16, fdtbl_y, DCY, tables.ydc, tables.yac);
+                    DCY = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, Y + 8, 16, fdtbl_y, DCY, tables.ydc, tables.yac);
+                    DCY = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, Y + 128, 16, fdtbl_y, DCY, tables.ydc, tables.yac);
+                    DCY = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, Y + 136, 16, fdtbl_y, DCY, tables.ydc, tables.yac);
+
+                    for(int yy = 0, i = 0; yy < 8; ++yy)
+                    {
+                        for(int xx = 0; xx < 8; ++xx, ++i)
+                        {
+                            int j = yy * 32 + xx * 2;
+                            subU[i] = (U[j + 0] + U[j + 1] + U[j + 16] + U[j + 17]) * 0.25f;
+                            subV[i] = (V[j + 0] + V[j + 1] + V[j + 16] + V[j + 17]) * 0.25f;
+                        }
+                    }
+
+                    DCU = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, subU, 8, fdtbl_uv, DCU, tables.uvdc, tables.uvac);
+                    DCV = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, subV, 8, fdtbl_uv, DCV, tables.uvdc, tables.uvac);
+                }
+                else
+                {
+                    DCY = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, Y, 8, fdtbl_y, DCY, tables.ydc, tables.yac);
+                    DCU = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, U, 8, fdtbl_uv, DCU, tables.uvdc, tables.uvac);
+                    DCV = stbiw__jpg_processDU(&s, &bitBuf, &bitCnt, V, 8, fdtbl_uv, DCV, tables.uvdc, tables.uvac);
+                }
+            }
+        }
+
+        // Byte-align with 1 bits, as before a restart marker or EOI
+        stbiw__jpg_writeBits(&s, &bitBuf, &bitCnt, fill_bits);
+    }
+
+    // Encode a view as baseline JPEG with the stb_image_write encoder, split over thread_count threads: the image is cut into strips of MCU rows,
+    // every strip is entropy-coded on its own thread as one restart interval (DRI/RSTn markers) and the strips are concatenated.
+    // A single strip gives exactly the bytes of stbi_write_jpg_to_func. Unlike stbi_write_jpg, rows may have a stride.
+    inline bool writeJpegParallel(stbi_write_func* func, void* context, const ImageView &view, int quality = 100, int thread_count = 0)
+    {
+        JpegTables tables;
+
+        if(!view.valid() || view.channels > 4 || view.width > 0xFFFF || view.height > 0xFFFF || !jpegTables(quality, tables))
+        {
+            return false;
+        }
+
+        int mcu_size = tables.subsample ? 16 : 8;
+        int mcus_per_row = (view.width + mcu_size - 1) / mcu_size;
+        int mcu_rows = (view.height + mcu_size - 1) / mcu_size;
+        thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+
+        // All restart intervals but the last one have the same number of MCUs, which has to fit in the 16 bits of DRI
+        int rows_per_strip = (mcu_rows + thread_count - 1) / std::max(1, thread_count);
+        rows_per_strip = std::max(1, std::min(rows_per_strip, 0xFFFF / mcus_per_row));
+        int strips = (mcu_rows + rows_per_strip - 1) / rows_per_strip;
+
+        std::vector<std::vector<unsigned char>> data(strips);
+
+        parallelRows(0, strips, thread_count, [&](int, int start_strip, int end_strip) {
+            for(int strip = start_strip; strip < end_strip; strip++)
+            {
+                data.at(strip).reserve((size_t)rows_per_strip * mcu_size * view.width);
+                jpegEncodeMcuRows(tables, view, strip * rows_per_strip, std::min(mcu_rows, (strip + 1) * rows_per_strip), data.at(strip));
+            }
+        });
+
+        // Header with the real dimensions, DRI goes right before SOS
+        std::vector<unsigned char> &header = tables.header;
+        header.at(tables.sof_offset + 5) = (unsigned char)(view.height >> 8);
+        header.at(tables.sof_offset + 6) = (unsigned char)view.height;
+        header.at(tables.sof_offset + 7) = (unsigned char)(view.width >> 8);
+        header.at(tables.sof_offset + 8) = (unsigned char)view.width;
+
+        if(strips > 1)
+        {
+            int interval = rows_per_strip * mcus_per_row;
+            unsigned char dri[] = {0xFF, 0xDD, 0, 4, (unsigned char)(interval >> 8), (unsigned char)interval};
+            header.insert(header.begin() + tables.sos_offset, dri, dri + sizeof(dri));
+        }
+
+        func(context, header.data(), (int)header.size());
+
+        for(int strip = 0; strip < strips; strip++)
+        {
+            func(context, data.at(strip).data(), (int)data.at(strip).size());
+
+            if(strip + 1 < strips)
+            {
+                unsigned char rst[] = {0xFF, (unsigned char)(0xD0 + strip % 8)};
+                func(context, rst, sizeof(rst));
+            }
+        }
+
+        unsigned char eoi[] = {0xFF, 0xD9};
+        func(context, eoi, sizeof(eoi));
+        return true;
+    }
+};
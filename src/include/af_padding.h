@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <tmmintrin.h>
+#define AF_HAS_SSSE3_PAD_DISPATCH 1
+#endif
+
+#include "af_image_view.h"
+#include "af_parallel.h"
+
+
+namespace af
+{
+    // How the pixels outside the image are made up (for a row "abcd")
+    enum class PadMode
+    {
+        Reflect,        // cba|abcd|dcb, the edge pixel is repeated (what padImageRgb always did)
+        Reflect101,     // dcb|abcd|cba, mirrored around the edge pixel
+        Clamp,          // aaa|abcd|ddd
+        Wrap,           // bcd|abcd|abc
+        Constant        // kkk|abcd|kkk
+    };
+
+    // Padding per side (in pixels)
+    struct Borders
+    {
+        int left = 0;
+        int top = 0;
+        int right = 0;
+        int bottom = 0;
+    };
+
+    // Map an index outside [0, size) back into it, -1 for PadMode::Constant
+    inline int padIndex(PadMode mode, int index, int size)
+    {
+        if(index >= 0 && index < size)
+        {
+            return index;
+        }
+
+        switch(mode)
+        {
+            case PadMode::Reflect:
+            {
+                int period = size * 2;
+                index = ((index % period) + period) % period;
+                return index < size ? index : period - 1 - index;
+            }
+            case PadMode::Reflect101:
+            {
+                if(size == 1)
+                {
+                    return 0;
+                }
+
+                int period = size * 2 - 2;
+                index = ((index % period) + period) % period;
+                return index < size ? index : period - index;
+            }
+            case PadMode::Clamp:
+                return index < 0 ? 0 : size - 1;
+            case PadMode::Wrap:
+                return ((index % size) + size) % size;
+            case PadMode::Constant:
+            default:
+                return -1;
+        }
+    }
+
+    // Copy pixels in reverse order: dst[i] = src[pixels - 1 - i], scalar version
+    inline void reversePixelsScalar(unsigned char* dst, const unsigned char* src, int pixels, int channels)
+    {
+        for(int i = 0; i < pixels; i++)
+        {
+            memcpy(dst + i * channels, src + (pixels - 1 - i) * channels, channels);
+        }
+    }
+
+#if defined(AF_HAS_SSSE3_PAD_DISPATCH)
+    // pshufb byte reversal for 1, 3 and 4 channels, returns the number of pixels done (from the start of dst / the end of src)
+    __attribute__((target("ssse3")))
+    inline int reversePixelsSsse3(unsigned char* dst, const unsigned char* src, int pixels, int channels)
+    {
+        int i = 0;
+
+        if(channels == 1)
+        {
+            const __m128i mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+            for(; i + 16 <= pixels; i += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(src + pixels - i - 16));
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(v, mask));
+            }
+        }
+        else if(channels == 4)
+        {
+            const __m128i mask = _mm_setr_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+            for(; i + 4 <= pixels; i += 4)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(src + (pixels - i - 4) * 4));
+                _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(v, mask));
+            }
+        }
+        else if(channels == 3)
+        {
+            // Five pixels (15 bytes) per step, the load starts one byte early and the 16th stored byte is rewritten by the next step,
+            // so both stay inside the segments as long as one more pixel follows
+            const __m128i mask = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, 0);
+
+            for(; i + 6 <= pixels; i += 5)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(src + (pixels - i - 5) * 3 - 1));
+                _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(v, mask));
+            }
+        }
+
+        return i;
+    }
+#endif
+
+    // Copy pixels in reverse order: dst[i] = src[pixels - 1 - i], dst and src must not overlap
+    inline void reversePixels(unsigned char* dst, const unsigned char* src, int pixels, int channels)
+    {
+        int done = 0;
+
+#if defined(AF_HAS_SSSE3_PAD_DISPATCH)
+        static bool has_ssse3 = __builtin_cpu_supports("ssse3");
+
+        if(has_ssse3)
+        {
+            done = reversePixelsSsse3(dst, src, pixels, channels);
+        }
+#endif
+
+        reversePixelsScalar(dst + done * channels, src, pixels - done, channels);
+    }
+
+    // Fill pixels with a constant pixel value
+    inline void fillPixels(unsigned char* dst, const unsigned char* value, int pixels, int channels)
+    {
+        if(pixels <= 0)
+        {
+            return;
+        }
+
+        memcpy(dst, value, channels);
+
+        // Double the filled part until the segment is full
+        for(int filled = 1; filled < pixels; filled *= 2)
+        {
+            memcpy(dst + filled * channels, dst, (size_t)std::min(filled, pixels - filled) * channels);
+        }
+    }
+
+    // Build one border segment of a row: the pixels at the (outside) columns [first_col, first_col + pixels) of the source row
+    inline void padSegment(PadMode mode, unsigned char* dst, const unsigned char* src_row, int first_col, int pixels, int width, int channels, const unsigned char* constant)
+    {
+        if(pixels <= 0)
+        {
+            return;
+        }
+
+        int last_col = first_col + pixels - 1;
+
+        // The common cases, where the segment maps to one run of source pixels, become one block copy
+        switch(mode)
+        {
+            case PadMode::Constant:
+                fillPixels(dst, constant, pixels, channels);
+                return;
+            case PadMode::Clamp:
+                fillPixels(dst, src_row + (first_col < 0 ? 0 : (width - 1) * channels), pixels, channels);
+                return;
+            case PadMode::Reflect:
+                if(last_col < 0 && first_col >= -width)
+                {
+                    reversePixels(dst, src_row + (-last_col - 1) * channels, pixels, channels);
+                    return;
+                }
+                if(first_col >= width && last_col < width * 2)
+                {
+                    reversePixels(dst, src_row + (width * 2 - 1 - last_col) * channels, pixels, channels);
+                    return;
+                }
+                break;
+            case PadMode::Reflect101:
+                if(last_col < 0 && first_col > -width)
+                {
+                    reversePixels(dst, src_row + (-last_col) * channels, pixels, channels);
+                    return;
+                }
+                if(first_col >= width && last_col < width * 2 - 1)
+                {
+                    reversePixels(dst, src_row + (width * 2 - 2 - last_col) * channels, pixels, channels);
+                    return;
+                }
+                break;
+            case PadMode::Wrap:
+                if(last_col < 0 && first_col >= -width)
+                {
+                    memcpy(dst, src_row + (first_col + width) * channels, (size_t)pixels * channels);
+                    return;
+                }
+                if(first_col >= width && last_col < width * 2)
+                {
+                    memcpy(dst, src_row + (first_col - width) * channels, (size_t)pixels * channels);
+                    return;
+                }
+                break;
+        }
+
+        // Borders wider than the image: pixel by pixel
+        for(int i = 0; i < pixels; i++)
+        {
+            memcpy(dst + i * channels, src_row + padIndex(mode, first_col + i, width) * channels, channels);
+        }
+    }
+
+    // Pad src into dst, which has to be larger by the borders. The rows are spread over thread_count threads, interior rows are one memcpy each.
+    // src may be the interior of dst itself (dst.crop(left, top, ...)), then only the borders are (re)built.
+    // constant holds one value per channel for PadMode::Constant (nullptr = zeros).
+    inline void padView(const ImageView &src, const ImageView &dst, Borders borders, PadMode mode = PadMode::Reflect,
+                        const unsigned char* constant = nullptr, int thread_count = 0)
+    {
+        if(!src.valid() || !dst.valid() ||
+           borders.left < 0 || borders.top < 0 || borders.right < 0 || borders.bottom < 0 ||
+           dst.width != src.width + borders.left + borders.right ||
+           dst.height != src.height + borders.top + borders.bottom ||
+           dst.channels != src.channels || src.channels > 16)
+        {
+            return; // TODO: Error-handling
+        }
+
+        unsigned char zeros[16] = {};
+        constant = constant != nullptr ? constant : zeros;
+        int channels = src.channels;
+        size_t row_bytes = (size_t)src.width * channels;
+        bool in_place = dst.pixel(borders.top, borders.left) == src.data;
+        thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+
+        parallelRows(0, dst.height, thread_count, [&](int, int start_row, int end_row) {
+            for(int row = start_row; row < end_row; row++)
+            {
+                unsigned char* dst_row = dst.row(row);
+                int src_row_index = padIndex(mode, row - borders.top, src.height);
+
+                if(src_row_index < 0)
+                {
+                    fillPixels(dst_row, constant, dst.width, channels);
+                    continue;
+                }
+
+                const unsigned char* src_row = src.row(src_row_index);
+                bool interior_row = row >= borders.top && row < borders.top + src.height;
+
+                if(!(in_place && interior_row))
+                {
+                    memcpy(dst_row + (size_t)borders.left * channels, src_row, row_bytes);
+                }
+
+                padSegment(mode, dst_row, src_row, -borders.left, borders.left, src.width, channels, constant);
+                padSegment(mode, dst_row + (size_t)(borders.left + src.width) * channels, src_row, src.width, borders.right, src.width, channels, constant);
+            }
+        });
+    }
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <functional>
+#include <algorithm>
+
+
+namespace af
+{
+    // Get the strip boundaries parallelRows uses: strip i covers [bounds[i], bounds[i + 1]), the last strip takes the remainder
+    inline std::vector<int> stripBounds(int start_row, int end_row, int thread_count)
+    {
+        int rows = std::max(0, end_row - start_row);
+        thread_count = std::max(1, std::min(thread_count, rows));
+        int rows_per_thread = rows / thread_count;
+        std::vector<int> bounds;
+
+        for(int i = 0; i < thread_count; i++)
+        {
+            bounds.push_back(start_row + rows_per_thread * i);
+        }
+
+        bounds.push_back(start_row + rows);
+        return bounds;
+    }
+
+    // Split the rows [start_row, end_row) into one strip per thread and run func(thread, strip_start, strip_end) on each strip, the last thread takes the remainder
+    inline void parallelRows(int start_row, int end_row, int thread_count, const std::function<void(int, int, int)> &func)
+    {
+        if(end_row - start_row <= 0)
+        {
+            return;
+        }
+
+        std::vector<int> bounds = stripBounds(start_row, end_row, thread_count);
+        int strips = (int)bounds.size() - 1;
+
+        if(strips == 1)
+        {
+            func(0, start_row, end_row);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+
+        for(int i = 0; i < strips; i++)
+        {
+            threads.push_back(std::thread(func, i, bounds.at(i), bounds.at(i + 1)));
+        }
+
+        for(int i = 0; i < strips; i++)
+        {
+            threads.at(i).join();
+        }
+    }
+};
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "af_image_threads.h"
+
+
+namespace af
+{
+    // Blocking FIFO with a fixed capacity: push() waits while the queue is full (back-pressure), pop() waits while it is empty
+    template<typename T>
+    class BoundedQueue
+    {
+    private:
+        std::deque<T> m_items;
+        size_t m_capacity;
+        bool m_closed = false;
+        std::mutex m_mutex;
+        std::condition_variable m_not_full;
+        std::condition_variable m_not_empty;
+
+    public:
+        explicit BoundedQueue(size_t capacity)
+        {
+            m_capacity = capacity > 0 ? capacity : 1;
+        }
+
+        // Add an item, false if the queue was closed
+        bool push(T item)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_full.wait(lock, [&]() { return m_items.size() < m_capacity || m_closed; });
+
+            if(m_closed)
+            {
+                return false;
+            }
+
+            m_items.push_back(std::move(item));
+            m_not_empty.notify_one();
+            return true;
+        }
+
+        // Take the oldest item, false once the queue is closed and drained
+        bool pop(T &item)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_empty.wait(lock, [&]() { return !m_items.empty() || m_closed; });
+
+            if(m_items.empty())
+            {
+                return false;
+            }
+
+            item = std::move(m_items.front());
+            m_items.pop_front();
+            m_not_full.notify_one();
+            return true;
+        }
+
+        // No more items will be pushed, waiting consumers finish with what is left
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+            m_not_full.notify_all();
+            m_not_empty.notify_all();
+        }
+    };
+
+    // Time the workers of one stage spent working, waiting for input and waiting for room in the next queue
+    struct StageStats
+    {
+        int workers = 0;
+        uint64_t items = 0;
+        double busy_seconds = 0;
+        double starved_seconds = 0;     // Waiting on an empty input queue (always 0 for decode, which reads from the job list)
+        double blocked_seconds = 0;     // Waiting on a full output queue (back-pressure)
+
+        // Share of the wall time the workers of this stage were busy
+        double utilization(double wall_seconds) const
+        {
+            return wall_seconds > 0 && workers > 0 ? busy_seconds / (wall_seconds * workers) : 0.0;
+        }
+    };
+
+    struct PipelineReport
+    {
+        StageStats decode;
+        StageStats filter;
+        StageStats encode;
+        double wall_seconds = 0;
+        int images = 0;     // Written successfully
+        int failed = 0;     // Could not be decoded or written
+
+        // The decode stage reads from the job list and never waits for input, its starved column is printed as "-"
+        void print(std::ostream &out = std::cout) const
+        {
+            const char* names[] = {"decode", "filter", "encode"};
+            const StageStats* stages[] = {&decode, &filter, &encode};
+            std::ios::fmtflags flags = out.flags();
+            std::streamsize precision = out.precision();
+
+            out << std::fixed << std::setprecision(1);
+            out << images << " images (" << failed << " failed) in " << wall_seconds * 1000.0 << " ms\n";
+            out << std::left << std::setw(8) << "stage" << std::right << std::setw(9) << "workers" << std::setw(9) << "items"
+                << std::setw(13) << "busy (ms)" << std::setw(13) << "starved (ms)" << std::setw(13) << "blocked (ms)" << std::setw(12) << "utilization" << "\n";
+
+            for(int i = 0; i < 3; i++)
+            {
+                out << std::left << std::setw(8) << names[i] << std::right << std::setw(9) << stages[i]->workers << std::setw(9) << stages[i]->items
+                    << std::setw(13) << stages[i]->busy_seconds * 1000.0;
+
+                if(stages[i] == &decode)
+                {
+                    out << std::setw(13) << "-";
+                }
+                else
+                {
+                    out << std::setw(13) << stages[i]->starved_seconds * 1000.0;
+                }
+
+                out << std::setw(13) << stages[i]->blocked_seconds * 1000.0
+                    << std::setprecision(0) << std::setw(11) << stages[i]->utilization(wall_seconds) * 100.0 << "%\n" << std::setprecision(1);
+            }
+
+            out.flags(flags);
+            out.precision(precision);
+        }
+    };
+
+    // One image of a batch: where it comes from and where the result goes
+    struct PipelineJob
+    {
+        std::string input;
+        std::string output;
+    };
+
+    struct PipelineOptions
+    {
+        int decode_workers = 2;
+        int filter_workers = 1;     // The filters are multi-threaded themselves
+        int encode_workers = 2;
+        int queue_depth = 2;        // Images waiting between two stages, bounds the memory to about (workers + depth) images per stage
+        WriteOptions write;
+    };
+
+    // Filter stage: turns a decoded image into the one to write (e.g. [&](Image &image) { return image.padded(1).filtered(kernel); })
+    using PipelineFilter = std::function<Image(Image &image)>;
+
+    // Decode -> filter -> encode over a batch with every stage on its own workers, connected by bounded queues. While one image is filtered,
+    // the next ones are decoded and the previous ones encoded; a slow stage makes the ones before it wait instead of piling up images.
+    inline PipelineReport runPipeline(const std::vector<PipelineJob> &jobs, const PipelineFilter &filter, PipelineOptions options = PipelineOptions())
+    {
+        using Clock = std::chrono::steady_clock;
+
+        struct Item
+        {
+            size_t job = 0;
+            Image image;
+        };
+
+        PipelineReport report;
+        report.decode.workers = std::max(1, options.decode_workers);
+        report.filter.workers = std::max(1, options.filter_workers);
+        report.encode.workers = std::max(1, options.encode_workers);
+
+        BoundedQueue<Item> decoded((size_t)std::max(1, options.queue_depth));
+        BoundedQueue<Item> filtered((size_t)std::max(1, options.queue_depth));
+        std::atomic<size_t> next_job(0);
+        std::atomic<int> decoders_left(report.decode.workers);
+        std::atomic<int> filters_left(report.filter.workers);
+        std::atomic<int> images(0);
+        std::atomic<int> failed(0);
+        std::mutex stats_mutex;
+
+        auto seconds = [](Clock::time_point start) {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        };
+
+        // Merge the times of one worker into the stage totals
+        auto merge = [&](StageStats &stage, const StageStats &local) {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stage.items += local.items;
+            stage.busy_seconds += local.busy_seconds;
+            stage.starved_seconds += local.starved_seconds;
+            stage.blocked_seconds += local.blocked_seconds;
+        };
+
+        auto decodeWorker = [&]() {
+            StageStats local;
+
+            for(size_t job = next_job++; job < jobs.size(); job = next_job++)
+            {
+                Clock::time_point start = Clock::now();
+                Item item;
+                item.job = job;
+                bool ok = item.image.loadMapped(jobs.at(job).input.c_str());
+                local.busy_seconds += seconds(start);
+
+                if(!ok)
+                {
+                    failed++;
+                    continue;
+                }
+
+                local.items++;
+                start = Clock::now();
+                decoded.push(std::move(item));
+                local.blocked_seconds += seconds(start);
+            }
+
+            merge(report.decode, local);
+
+            if(--decoders_left == 0)
+            {
+                decoded.close();
+            }
+        };
+
+        auto filterWorker = [&]() {
+            StageStats local;
+            Item item;
+
+            while(true)
+            {
+                Clock::time_point start = Clock::now();
+
+                if(!decoded.pop(item))
+                {
+                    break;
+                }
+
+                local.starved_seconds += seconds(start);
+                start = Clock::now();
+                Item result;
+                result.job = item.job;
+                result.image = filter ? filter(item.image) : std::move(item.image);
+                item.image.destroy();
+                local.busy_seconds += seconds(start);
+                local.items++;
+
+                start = Clock::now();
+                filtered.push(std::move(result));
+                local.blocked_seconds += seconds(start);
+            }
+
+            merge(report.filter, local);
+
+            if(--filters_left == 0)
+            {
+                filtered.close();
+            }
+        };
+
+        auto encodeWorker = [&]() {
+            StageStats local;
+            Item item;
+
+            while(true)
+            {
+                Clock::time_point start = Clock::now();
+
+                if(!filtered.pop(item))
+                {
+                    break;
+                }
+
+                local.starved_seconds += seconds(start);
+                start = Clock::now();
+                bool ok = item.image.write(jobs.at(item.job).output.c_str(), options.write);
+                item.image.destroy();
+                local.busy_seconds += seconds(start);
+                local.items++;
+                ok ? images++ : failed++;
+            }
+
+            merge(report.encode, local);
+        };
+
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> threads;
+
+        for(int i = 0; i < report.decode.workers; i++)
+        {
+            threads.push_back(std::thread(decodeWorker));
+        }
+
+        for(int i = 0; i < report.filter.workers; i++)
+        {
+            threads.push_back(std::thread(filterWorker));
+        }
+
+        for(int i = 0; i < report.encode.workers; i++)
+        {
+            threads.push_back(std::thread(encodeWorker));
+        }
+
+        for(std::thread &thread : threads)
+        {
+            thread.join();
+        }
+
+        report.wall_seconds = seconds(start);
+        report.images = images;
+        report.failed = failed;
+        return report;
+    }
+};
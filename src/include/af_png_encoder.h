@@ -0,0 +1,118 @@
+#pragma once
+
+// Needs the stb_image_write implementation in the same translation unit (included by af_image_threads.h before this header)
+
+#include <vector>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+#include "af_image_view.h"
+#include "af_parallel.h"
+#include "af_deflate.h"
+
+
+namespace af
+{
+    // Options of the parallel PNG writer
+    struct PngOptions
+    {
+        int level = 8;          // Deflate level 0 (store) .. 9, 8 is the stb_image_write default
+        int force_filter = -1;  // 0..4 forces one PNG filter for every row, -1 picks the best one per row (like stbi_write_force_png_filter)
+    };
+
+    // Encode a view as PNG: the rows are filtered in strips on thread_count threads (per-row filter choice of stbi_write_png_to_mem),
+    // the filtered data is compressed with zlibCompressParallel. Rows may have a stride.
+    inline bool writePngParallel(stbi_write_func* func, void* context, const ImageView &view, PngOptions options = PngOptions(), int thread_count = 0)
+    {
+        if(!view.valid() || view.channels > 4)
+        {
+            return false;
+        }
+
+        int width = view.width;
+        int height = view.height;
+        int n = view.channels;
+        size_t line = (size_t)width * n + 1;
+        int force_filter = options.force_filter >= 5 ? -1 : options.force_filter;
+        std::vector<unsigned char> filtered(line * height);
+        thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+
+        parallelRows(0, height, thread_count, [&](int, int start_row, int end_row) {
+            std::vector<signed char> line_buffer((size_t)width * n);
+
+            for(int row = start_row; row < end_row; row++)
+            {
+                unsigned char* out = filtered.data() + line * row;
+                int best_filter = force_filter;
+
+                if(force_filter < 0)
+                {
+                    // Estimate the entropy of the line for every filter, the less the better
+                    int best_value = 0x7fffffff;
+
+                    for(int filter_type = 0; filter_type < 5; filter_type++)
+                    {
+                        stbiw__encode_png_line(view.data, view.stride, width, height, row, n, filter_type, line_buffer.data());
+                        int estimate = 0;
+
+                        for(size_t i = 0; i < line_buffer.size(); i++)
+                        {
+                            estimate += abs(line_buffer[i]);
+                        }
+
+                        if(estimate < best_value)
+                        {
+                            best_value = estimate;
+                            best_filter = filter_type;
+                        }
+                    }
+                }
+
+                stbiw__encode_png_line(view.data, view.stride, width, height, row, n, best_filter, line_buffer.data());
+                out[0] = (unsigned char)best_filter;
+                memcpy(out + 1, line_buffer.data(), line_buffer.size());
+            }
+        });
+
+        std::vector<unsigned char> zlib = zlibCompressParallel(filtered.data(), filtered.size(), options.level, thread_count);
+        filtered = std::vector<unsigned char>();
+
+        // Signature, IHDR, IDAT, IEND, every chunk with its CRC (over the tag and the data)
+        static const int ctype[5] = {-1, 0, 4, 2, 6};
+        std::vector<unsigned char> head = {137, 80, 78, 71, 13, 10, 26, 10};
+
+        auto put32 = [](std::vector<unsigned char> &out, uint32_t value) {
+            unsigned char bytes[4] = {(unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value};
+            out.insert(out.end(), bytes, bytes + 4);
+        };
+
+        auto chunk = [&](const char* tag, const unsigned char* data, uint32_t size) {
+            std::vector<unsigned char> tagged(tag, tag + 4);
+            tagged.insert(tagged.end(), data, data + size);
+            std::vector<unsigned char> frame;
+            put32(frame, size);
+            func(context, frame.data(), (int)frame.size());
+            func(context, tagged.data(), (int)tagged.size());
+            frame.clear();
+            put32(frame, stbiw__crc32(tagged.data(), (int)tagged.size()));
+            func(context, frame.data(), (int)frame.size());
+        };
+
+        std::vector<unsigned char> ihdr;
+        put32(ihdr, width);
+        put32(ihdr, height);
+        ihdr.push_back(8);
+        ihdr.push_back((unsigned char)ctype[n]);
+        ihdr.push_back(0);
+        ihdr.push_back(0);
+        ihdr.push_back(0);
+
+        func(context, head.data(), (int)head.size());
+        chunk("IHDR", ihdr.data(), (uint32_t)ihdr.size());
+        chunk("IDAT", zlib.data(), (uint32_t)zlib.size());
+        chunk("IEND", nullptr, 0);
+        return true;
+    }
+};
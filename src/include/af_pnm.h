@@ -0,0 +1,352 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <climits>
+#include <thread>
+
+#include "af_image_view.h"
+#include "af_parallel.h"
+#include "af_afraw.h"
+
+
+
+namespace af
+{
+    // Header of a binary PGM (P5), PPM (P6) or PFM (Pf grey, PF color) file
+    struct PnmHeader
+    {
+        int width = 0;
+        int height = 0;
+        int channels = 0;           // 1 or 3
+        int maxval = 255;           // PGM / PPM: 255 or less is one byte per sample, up to 65535 two (big-endian)
+        bool is_float = false;      // PFM: 32-bit floats, rows stored bottom to top
+        bool little_endian = false; // PFM byte order (negative scale)
+        size_t header_size = 0;     // Offset of the first sample
+
+        int sampleBytes() const
+        {
+            return is_float ? 4 : (maxval > 255 ? 2 : 1);
+        }
+
+        size_t rowBytes() const
+        {
+            return (size_t)width * channels * sampleBytes();
+        }
+
+        size_t dataSize() const
+        {
+            return rowBytes() * height;
+        }
+    };
+
+    // Parse the header at the start of data: 1 if it is complete and valid, 0 if more bytes are needed, -1 if it is not a binary PNM/PFM
+    inline int parsePnmHeader(const unsigned char* data, size_t size, PnmHeader &header)
+    {
+        if(size < 2)
+        {
+            return size == 1 && data[0] != 'P' ? -1 : 0;
+        }
+
+        if(data[0] != 'P' || (data[1] != '5' && data[1] != '6' && data[1] != 'f' && data[1] != 'F'))
+        {
+            return -1;
+        }
+
+        header = PnmHeader();
+        header.is_float = data[1] == 'f' || data[1] == 'F';
+        header.channels = (data[1] == '5' || data[1] == 'f') ? 1 : 3;
+        size_t pos = 2;
+
+        // The next whitespace separated token (comments only in PGM / PPM headers), false if the data ends before it does
+        auto token = [&](char* out, size_t out_size) {
+            while(pos < size)
+            {
+                if(data[pos] == '#' && !header.is_float)
+                {
+                    while(pos < size && data[pos] != '\n')
+                    {
+                        pos++;
+                    }
+                }
+                else if(isspace(data[pos]))
+                {
+                    pos++;
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            size_t length = 0;
+
+            while(pos < size && !isspace(data[pos]) && length + 1 < out_size)
+            {
+                out[length++] = (char)data[pos++];
+            }
+
+            out[length] = 0;
+            return pos < size && length > 0;
+        };
+
+        char width[16], height[16], last[32];
+
+        if(!token(width, sizeof(width)) || !token(height, sizeof(height)) || !token(last, sizeof(last)))
+        {
+            return size > 256 ? -1 : 0;     // Real headers are short, do not keep waiting on garbage
+        }
+
+        pos++;  // Exactly one whitespace character before the samples
+        char* end = nullptr;
+        long w = strtol(width, &end, 10);
+        bool valid = *end == 0;
+        long h = strtol(height, &end, 10);
+        valid = valid && *end == 0 && w > 0 && h > 0 && w < INT_MAX / 16 && h < INT_MAX / 16;
+
+        if(header.is_float)
+        {
+            double scale = strtod(last, &end);
+            valid = valid && *end == 0 && scale != 0;
+            header.little_endian = scale < 0;
+            header.maxval = 0;
+        }
+        else
+        {
+            long maxval = strtol(last, &end, 10);
+            valid = valid && *end == 0 && maxval > 0 && maxval <= 65535;
+            header.maxval = (int)maxval;
+        }
+
+        header.width = (int)w;
+        header.height = (int)h;
+        header.header_size = pos;
+        return valid ? 1 : -1;
+    }
+
+    // Write the header of an output file with bits per sample (8, 16 or 32 for PFM) and 1 or 3 channels, returns its length
+    inline int makePnmHeader(char* out, size_t size, int width, int height, int channels, int bits)
+    {
+        if(bits == 32)
+        {
+            return snprintf(out, size, "P%c\n%d %d\n-1.0\n", channels == 1 ? 'f' : 'F', width, height);
+        }
+
+        return snprintf(out, size, "P%c\n%d %d\n%d\n", channels == 1 ? '5' : '6', width, height, bits == 16 ? 65535 : 255);
+    }
+
+    inline bool hostLittleEndian()
+    {
+        const uint16_t value = 1;
+        return *(const uint8_t*)&value == 1;
+    }
+
+    // Convert the samples of a file (starting at the first sample) into an 8-bit view of header.channels channels, rows in parallel.
+    // Samples are scaled from 0..maxval to 0..255, PFM floats are clamped to 0..1 (linear, no tone mapping).
+    inline void pnmToView(const PnmHeader &header, const unsigned char* samples, const ImageView &dst, int thread_count)
+    {
+        bool swap = header.is_float && header.little_endian != hostLittleEndian();
+        size_t row_bytes = header.rowBytes();
+        int count = header.width * header.channels;
+        uint8_t lut[256];
+
+        for(int value = 0; value < 256; value++)
+        {
+            lut[value] = (uint8_t)((std::min(value, header.maxval) * 255 + header.maxval / 2) / std::max(header.maxval, 1));
+        }
+
+        parallelRows(0, header.height, thread_count, [&](int, int start, int end) {
+            for(int row = start; row < end; row++)
+            {
+                // PFM stores the bottom row first
+                const unsigned char* src = samples + (size_t)(header.is_float ? header.height - 1 - row : row) * row_bytes;
+                unsigned char* out = dst.data + (size_t)row * dst.stride;
+
+                if(header.is_float)
+                {
+                    for(int i = 0; i < count; i++, src += 4)
+                    {
+                        unsigned char bytes[4] = {src[0], src[1], src[2], src[3]};
+
+                        if(swap)
+                        {
+                            std::swap(bytes[0], bytes[3]);
+                            std::swap(bytes[1], bytes[2]);
+                        }
+
+                        float value;
+                        memcpy(&value, bytes, 4);
+                        value = value > 0 ? (value < 1 ? value : 1) : 0;    // Also maps NaN to 0
+                        out[i] = (unsigned char)(value * 255.0f + 0.5f);
+                    }
+                }
+                else if(header.maxval > 255)
+                {
+                    for(int i = 0; i < count; i++, src += 2)
+                    {
+                        int value = std::min((src[0] << 8) | src[1], header.maxval);
+                        out[i] = (unsigned char)((value * 255 + header.maxval / 2) / header.maxval);
+                    }
+                }
+                else if(header.maxval == 255)
+                {
+                    memcpy(out, src, count);
+                }
+                else
+                {
+                    for(int i = 0; i < count; i++)
+                    {
+                        out[i] = lut[src[i]];
+                    }
+                }
+            }
+        });
+    }
+
+    // Encode one row of an 8-bit view (alpha dropped, 1 or 2 channels -> grey, 3 or 4 -> RGB) with bits per sample (8, 16 or 32 float)
+    inline void pnmEncodeRow(const unsigned char* src, int channels, int width, int bits, unsigned char* out)
+    {
+        int out_channels = channels <= 2 ? 1 : 3;
+        bool swap = !hostLittleEndian();
+
+        for(int col = 0; col < width; col++, src += channels)
+        {
+            for(int c = 0; c < out_channels; c++)
+            {
+                unsigned char value = src[c];
+
+                if(bits == 32)
+                {
+                    float sample = value / 255.0f;
+                    memcpy(out, &sample, 4);
+
+                    if(swap)
+                    {
+                        std::swap(out[0], out[3]);
+                        std::swap(out[1], out[2]);
+                    }
+
+                    out += 4;
+                }
+                else if(bits == 16)
+                {
+                    *out++ = value;     // value * 257, big-endian
+                    *out++ = value;
+                }
+                else
+                {
+                    *out++ = value;
+                }
+            }
+        }
+    }
+
+    // Produce a PGM / PPM (bits 8 or 16) or PFM (bits 32) file from a view: out(data, size) gets the header and then the rows in file order
+    // (PFM bottom to top) and returns false to stop. 8-bit grey or RGB views with packed rows are passed where they are in one piece, all
+    // others are encoded band by band (rows in parallel), so only a few MiB are buffered. data is only valid during the call.
+    template<typename Output>
+    inline bool pnmWriteRows(const ImageView &view, int bits, int thread_count, Output out)
+    {
+        if(view.data == nullptr || view.width <= 0 || view.height <= 0 || view.channels < 1 || view.channels > 4 ||
+           (bits != 8 && bits != 16 && bits != 32))
+        {
+            return false;
+        }
+
+        int out_channels = view.channels <= 2 ? 1 : 3;
+        char header[64];
+        int header_size = makePnmHeader(header, sizeof(header), view.width, view.height, out_channels, bits);
+
+        if(!out((const unsigned char*)header, (size_t)header_size))
+        {
+            return false;
+        }
+
+        size_t row_bytes = (size_t)view.width * out_channels * (bits / 8);
+
+        if(bits == 8 && view.channels == out_channels && (size_t)view.stride == row_bytes)
+        {
+            return out(view.data, row_bytes * view.height);
+        }
+
+        int band_rows = (int)std::max((size_t)1, std::min((size_t)view.height, ((size_t)4 << 20) / row_bytes));
+        std::vector<unsigned char> band(row_bytes * band_rows);
+        thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+
+        for(int first = 0; first < view.height; first += band_rows)
+        {
+            int count = std::min(band_rows, view.height - first);
+
+            parallelRows(0, count, thread_count, [&](int, int start, int end) {
+                for(int i = start; i < end; i++)
+                {
+                    int file_row = first + i;
+                    int row = bits == 32 ? view.height - 1 - file_row : file_row;
+                    pnmEncodeRow(view.data + (size_t)row * view.stride, view.channels, view.width, bits, band.data() + i * row_bytes);
+                }
+            });
+
+            if(!out(band.data(), row_bytes * count))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+#if defined(AF_HAS_AFRAW_IO)
+    // read() until size bytes are in or the input ends, returns the bytes read
+    inline size_t readAll(int fd, unsigned char* data, size_t size)
+    {
+        size_t total = 0;
+
+        while(total < size)
+        {
+            ssize_t count = ::read(fd, data + total, size - total);
+
+            if(count <= 0)
+            {
+                break;
+            }
+
+            total += (size_t)count;
+        }
+
+        return total;
+    }
+
+    // Read a header from a file or a pipe. head receives the bytes read so far, the header and possibly the start of the samples.
+    inline bool readPnmHeader(int fd, PnmHeader &header, std::vector<unsigned char> &head)
+    {
+        head.clear();
+
+        while(true)
+        {
+            size_t size = head.size();
+            head.resize(size + 512);
+            ssize_t count = ::read(fd, head.data() + size, 512);
+            head.resize(size + (count > 0 ? (size_t)count : 0));
+
+            int result = parsePnmHeader(head.data(), head.size(), header);
+
+            if(result != 0 || count <= 0)
+            {
+                return result == 1;
+            }
+        }
+    }
+
+    // Write a PGM / PPM (bits 8 or 16) or PFM (bits 32) to a file descriptor
+    inline bool writePnm(int fd, const ImageView &view, int bits = 8, int thread_count = 0)
+    {
+        return pnmWriteRows(view, bits, thread_count, [fd](const unsigned char* data, size_t size) {
+            return writeAll(fd, data, size);
+        });
+    }
+#endif
+};
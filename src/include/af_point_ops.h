@@ -0,0 +1,165 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+
+namespace af
+{
+    // Chain of per-pixel tone adjustments (uint8 -> uint8), every operation is folded into one 256-entry lookup table per channel when it is added,
+    // so applying the whole chain costs a single read and write of the image no matter how many operations it contains
+    class PointOps
+    {
+    private:
+        uint8_t m_lut[4][256];
+        bool m_identity = true;
+
+        // Compose func after the current table of the given channel (-1 = all colour channels, alpha is left alone)
+        PointOps& fold(int channel, const std::function<float(float)> &func)
+        {
+            int first = channel < 0 ? 0 : channel;
+            int last = channel < 0 ? 2 : channel;
+
+            for(int c = first; c <= last && c < 4; c++)
+            {
+                for(int value = 0; value < 256; value++)
+                {
+                    float result = std::round(func((float)m_lut[c][value]));
+                    m_lut[c][value] = (uint8_t)std::min(255.0F, std::max(0.0F, result));
+                }
+            }
+
+            m_identity = false;
+            return *this;
+        }
+
+    public:
+        PointOps()
+        {
+            reset();
+        }
+
+        // Go back to the identity mapping
+        PointOps& reset()
+        {
+            for(int c = 0; c < 4; c++)
+            {
+                for(int value = 0; value < 256; value++)
+                {
+                    m_lut[c][value] = (uint8_t)value;
+                }
+            }
+
+            m_identity = true;
+            return *this;
+        }
+
+        // Gamma correction, values > 1 brighten the midtones
+        PointOps& gamma(float gamma, int channel = -1)
+        {
+            float exponent = 1.0F / std::max(gamma, 0.0001F);
+
+            return fold(channel, [exponent](float value) {
+                return 255.0F * std::pow(value / 255.0F, exponent);
+            });
+        }
+
+        // Levels: map [in_black, in_white] to [out_black, out_white] with an optional midtone gamma in between
+        PointOps& levels(int in_black, int in_white, int out_black = 0, int out_white = 255, float gamma = 1.0F, int channel = -1)
+        {
+            float range = (float)std::max(1, in_white - in_black);
+            float exponent = 1.0F / std::max(gamma, 0.0001F);
+
+            return fold(channel, [=](float value) {
+                float normalized = std::min(1.0F, std::max(0.0F, (value - in_black) / range));
+                return out_black + (out_white - out_black) * std::pow(normalized, exponent);
+            });
+        }
+
+        // Curves: piecewise linear mapping through the given (input, output) control points
+        PointOps& curve(std::vector<std::pair<int, int>> points, int channel = -1)
+        {
+            if(points.empty())
+            {
+                return *this;
+            }
+
+            std::sort(points.begin(), points.end());
+
+            return fold(channel, [&points](float value) {
+                if(value <= points.front().first)
+                {
+                    return (float)points.front().second;
+                }
+
+                for(size_t i = 1; i < points.size(); i++)
+                {
+                    if(value <= points.at(i).first)
+                    {
+                        float x0 = points.at(i - 1).first;
+                        float x1 = points.at(i).first;
+                        float y0 = points.at(i - 1).second;
+                        float y1 = points.at(i).second;
+                        return x1 == x0 ? y1 : y0 + (y1 - y0) * (value - x0) / (x1 - x0);
+                    }
+                }
+
+                return (float)points.back().second;
+            });
+        }
+
+        // Add a constant offset
+        PointOps& brightness(int offset, int channel = -1)
+        {
+            return fold(channel, [offset](float value) {
+                return value + offset;
+            });
+        }
+
+        // Scale the distance to mid-grey
+        PointOps& contrast(float factor, int channel = -1)
+        {
+            return fold(channel, [factor](float value) {
+                return (value - 128.0F) * factor + 128.0F;
+            });
+        }
+
+        // Invert the values
+        PointOps& invert(int channel = -1)
+        {
+            return fold(channel, [](float value) {
+                return 255.0F - value;
+            });
+        }
+
+        // Any other mapping
+        PointOps& custom(const std::function<uint8_t(uint8_t)> &func, int channel = -1)
+        {
+            return fold(channel, [&func](float value) {
+                return (float)func((uint8_t)value);
+            });
+        }
+
+        // Get the lookup table of a channel
+        const uint8_t* getLut(int channel) const
+        {
+            return m_lut[std::min(std::max(channel, 0), 3)];
+        }
+
+        // Table index of a channel of an image with channels channels: the second channel of grey + alpha is alpha, like the fourth of RGBA
+        static int lutIndex(int channel, int channels)
+        {
+            return channels == 2 && channel == 1 ? 3 : channel;
+        }
+
+        // True as long as no operation has been added
+        bool isIdentity() const
+        {
+            return m_identity;
+        }
+    };
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+// Needs the stb_image implementation in the same translation unit (included by af_image_threads.h before this header)
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+
+#include "af_afraw.h"
+#include "af_pnm.h"
+#include "af_qoi.h"
+
+
+namespace af
+{
+    // What an image file holds, read from its header without decoding the pixels
+    struct ImageInfo
+    {
+        bool valid = false;
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        bool is_16_bit = false;     // 16 bits per channel (PNG, PNM), decoded to 8 bits by Image::load
+        bool is_hdr = false;        // Float samples (Radiance HDR, PFM), mapped to 8 bits by Image::load
+        bool is_afraw = false;      // Native format, see Image::mapFile
+        size_t file_size = 0;
+
+        // Bytes of the decoded 8-bit image with rows of stride bytes rounded up to alignment (Image::alignedStride for alignment 64)
+        size_t decodedSize(int alignment = 64) const
+        {
+            size_t stride = (((size_t)width * channels + alignment - 1) / alignment) * alignment;
+            return stride * height;
+        }
+    };
+
+    // Fill info from an .afraw header, false if the bytes are not one
+    inline bool probeAfRaw(const unsigned char* data, size_t size, uint64_t file_size, ImageInfo &info)
+    {
+        AfRawHeader header;
+
+        if(size < sizeof(header))
+        {
+            return false;
+        }
+
+        memcpy(&header, data, sizeof(header));
+
+        if(!afRawHeaderValid(header, file_size))
+        {
+            return false;
+        }
+
+        info.valid = true;
+        info.is_afraw = true;
+        info.width = header.width;
+        info.height = header.height;
+        info.channels = header.channels;
+        return true;
+    }
+
+    // Fill info from a binary PGM / PPM / PFM header, false if the bytes do not start with one. stb_image reads these as well except
+    // PFM, but this also gives the exact sample depth.
+    inline bool probePnm(const unsigned char* data, size_t size, ImageInfo &info)
+    {
+        PnmHeader header;
+
+        if(parsePnmHeader(data, size, header) != 1)
+        {
+            return false;
+        }
+
+        info.valid = true;
+        info.width = header.width;
+        info.height = header.height;
+        info.channels = header.channels;
+        info.is_16_bit = header.maxval > 255;
+        info.is_hdr = header.is_float;
+        return true;
+    }
+
+    // Fill info from a QOI header, false if the bytes are not one (stb_image does not read QOI)
+    inline bool probeQoi(const unsigned char* data, size_t size, ImageInfo &info)
+    {
+        QoiHeader header;
+
+        if(!parseQoiHeader(data, size, header))
+        {
+            return false;
+        }
+
+        info.valid = true;
+        info.width = header.width;
+        info.height = header.height;
+        info.channels = header.channels;
+        return true;
+    }
+
+    // Probe an encoded image in memory
+    inline ImageInfo probeMemory(const unsigned char* data, size_t size)
+    {
+        ImageInfo info;
+        info.file_size = size;
+
+        if(data == nullptr || size == 0 || size > (size_t)INT_MAX || probeAfRaw(data, size, size, info) || probePnm(data, size, info) ||
+           probeQoi(data, size, info))
+        {
+            return info;
+        }
+
+        info.valid = stbi_info_from_memory(data, (int)size, &info.width, &info.height, &info.channels) != 0;
+        info.is_16_bit = info.valid && stbi_is_16_bit_from_memory(data, (int)size) != 0;
+        info.is_hdr = info.valid && stbi_is_hdr_from_memory(data, (int)size) != 0;
+        return info;
+    }
+
+    // Probe an image file: one open, only the headers are read
+    inline ImageInfo probeFile(const char* path)
+    {
+        ImageInfo info;
+        FILE* file = path != nullptr ? fopen(path, "rb") : nullptr;
+
+        if(file == nullptr)
+        {
+            return info;
+        }
+
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        info.file_size = size > 0 ? (size_t)size : 0;
+
+        unsigned char head[256];    // An .afraw, PNM or QOI header
+        size_t head_size = fread(head, 1, sizeof(head), file);
+        fseek(file, 0, SEEK_SET);
+
+        if(!probeAfRaw(head, head_size, info.file_size, info) && !probePnm(head, head_size, info) && !probeQoi(head, head_size, info))
+        {
+            // The stbi_*_from_file functions seek back to where they started
+            info.valid = stbi_info_from_file(file, &info.width, &info.height, &info.channels) != 0;
+            info.is_16_bit = info.valid && stbi_is_16_bit_from_file(file) != 0;
+            info.is_hdr = info.valid && stbi_is_hdr_from_file(file) != 0;
+        }
+
+        fclose(file);
+        return info;
+    }
+};
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "af_image_view.h"
+
+
+namespace af
+{
+    // QOI, the "Quite OK Image" format (qoiformat.org): lossless RGB / RGBA, one pass and a 64-entry color cache, so encoding and decoding
+    // run at memory speed with sizes close to PNG
+
+    const unsigned char QOI_MAGIC[4] = {'q', 'o', 'i', 'f'};
+    const size_t QOI_HEADER_SIZE = 14;
+    const unsigned char QOI_PADDING[8] = {0, 0, 0, 0, 0, 0, 0, 1};  // End marker
+
+    const unsigned char QOI_OP_INDEX = 0x00;    // 00xxxxxx
+    const unsigned char QOI_OP_DIFF = 0x40;     // 01xxxxxx
+    const unsigned char QOI_OP_LUMA = 0x80;     // 10xxxxxx
+    const unsigned char QOI_OP_RUN = 0xc0;      // 11xxxxxx
+    const unsigned char QOI_OP_RGB = 0xfe;
+    const unsigned char QOI_OP_RGBA = 0xff;
+    const unsigned char QOI_MASK = 0xc0;
+
+    struct QoiHeader
+    {
+        int width = 0;
+        int height = 0;
+        int channels = 0;       // 3 or 4
+        int colorspace = 0;     // 0 sRGB with linear alpha, 1 all channels linear (informative only)
+    };
+
+    struct QoiPixel
+    {
+        unsigned char r, g, b, a;
+
+        bool operator==(const QoiPixel &other) const
+        {
+            return r == other.r && g == other.g && b == other.b && a == other.a;
+        }
+
+        int hash() const
+        {
+            return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+        }
+    };
+
+    inline uint32_t readBigEndian32(const unsigned char* data)
+    {
+        return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    }
+
+    inline void writeBigEndian32(unsigned char* data, uint32_t value)
+    {
+        data[0] = (unsigned char)(value >> 24);
+        data[1] = (unsigned char)(value >> 16);
+        data[2] = (unsigned char)(value >> 8);
+        data[3] = (unsigned char)value;
+    }
+
+    // Read the header at the start of data, false if it is not a QOI file
+    inline bool parseQoiHeader(const unsigned char* data, size_t size, QoiHeader &header)
+    {
+        if(data == nullptr || size < QOI_HEADER_SIZE || memcmp(data, QOI_MAGIC, 4) != 0)
+        {
+            return false;
+        }
+
+        uint32_t width = readBigEndian32(data + 4);
+        uint32_t height = readBigEndian32(data + 8);
+        header.width = (int)width;
+        header.height = (int)height;
+        header.channels = data[12];
+        header.colorspace = data[13];
+
+        // The reference implementation limits images to 400 million pixels
+        return width > 0 && height > 0 && (uint64_t)width * height <= 400000000ULL && (header.channels == 3 || header.channels == 4) &&
+               header.colorspace <= 1;
+    }
+
+    // Decode the pixels of a QOI file into a view of header.channels channels, false if the data ends early
+    inline bool qoiDecode(const unsigned char* data, size_t size, const QoiHeader &header, const ImageView &dst)
+    {
+        if(data == nullptr || size < QOI_HEADER_SIZE + sizeof(QOI_PADDING) || dst.data == nullptr ||
+           dst.width != header.width || dst.height != header.height || dst.channels != header.channels)
+        {
+            return false;
+        }
+
+        QoiPixel index[64] = {};
+        QoiPixel pixel = {0, 0, 0, 255};
+        const unsigned char* in = data + QOI_HEADER_SIZE;
+        const unsigned char* end = data + size - sizeof(QOI_PADDING);  // Every op is complete before the end marker
+        int channels = header.channels;
+        int run = 0;
+
+        for(int row = 0; row < header.height; row++)
+        {
+            unsigned char* out = dst.data + (size_t)row * dst.stride;
+
+            for(int col = 0; col < header.width; col++, out += channels)
+            {
+                if(run > 0)
+                {
+                    run--;
+                }
+                else
+                {
+                    if(in >= end)
+                    {
+                        return false;
+                    }
+
+                    unsigned char op = *in++;
+
+                    if(op == QOI_OP_RGB)
+                    {
+                        if(end - in < 3)
+                        {
+                            return false;
+                        }
+
+                        pixel.r = in[0];
+                        pixel.g = in[1];
+                        pixel.b = in[2];
+                        in += 3;
+                    }
+                    else if(op == QOI_OP_RGBA)
+                    {
+                        if(end - in < 4)
+                        {
+                            return false;
+                        }
+
+                        pixel.r = in[0];
+                        pixel.g = in[1];
+                        pixel.b = in[2];
+                        pixel.a = in[3];
+                        in += 4;
+                    }
+                    else if((op & QOI_MASK) == QOI_OP_INDEX)
+                    {
+                        pixel = index[op];
+                    }
+                    else if((op & QOI_MASK) == QOI_OP_DIFF)
+                    {
+                        pixel.r += ((op >> 4) & 0x03) - 2;
+                        pixel.g += ((op >> 2) & 0x03) - 2;
+                        pixel.b += (op & 0x03) - 2;
+                    }
+                    else if((op & QOI_MASK) == QOI_OP_LUMA)
+                    {
+                        if(in >= end)
+                        {
+                            return false;
+                        }
+
+                        int dg = (op & 0x3f) - 32;
+                        unsigned char next = *in++;
+                        pixel.r += dg - 8 + ((next >> 4) & 0x0f);
+                        pixel.g += dg;
+                        pixel.b += dg - 8 + (next & 0x0f);
+                    }
+                    else
+                    {
+                        run = op & 0x3f;    // This pixel and run more
+                    }
+
+                    index[pixel.hash()] = pixel;
+                }
+
+                out[0] = pixel.r;
+                out[1] = pixel.g;
+                out[2] = pixel.b;
+
+                if(channels == 4)
+                {
+                    out[3] = pixel.a;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Encode a view as QOI through an stbi_write_func-style callback, in blocks of about 64 KiB. 3 and 4 channel views are stored as
+    // they are, grey (1 channel) is stored as RGB and grey + alpha (2 channels) as RGBA, since QOI has no grey formats.
+    inline bool writeQoi(void (*func)(void* context, void* data, int size), void* context, const ImageView &view, int colorspace = 0)
+    {
+        if(view.data == nullptr || view.width <= 0 || view.height <= 0 || view.channels < 1 || view.channels > 4)
+        {
+            return false;
+        }
+
+        const size_t block_size = 64 * 1024;
+        std::vector<unsigned char> block(block_size + 16);
+        unsigned char* out = block.data();
+        int channels = view.channels;
+        bool has_alpha = channels == 2 || channels == 4;
+
+        auto flush = [&]() {
+            func(context, block.data(), (int)(out - block.data()));
+            out = block.data();
+        };
+
+        memcpy(out, QOI_MAGIC, 4);
+        writeBigEndian32(out + 4, (uint32_t)view.width);
+        writeBigEndian32(out + 8, (uint32_t)view.height);
+        out[12] = has_alpha ? 4 : 3;
+        out[13] = (unsigned char)colorspace;
+        out += QOI_HEADER_SIZE;
+
+        QoiPixel index[64] = {};
+        QoiPixel previous = {0, 0, 0, 255};
+        QoiPixel pixel = previous;
+        int run = 0;
+
+        for(int row = 0; row < view.height; row++)
+        {
+            const unsigned char* src = view.data + (size_t)row * view.stride;
+            bool last_row = row == view.height - 1;
+
+            for(int col = 0; col < view.width; col++, src += channels)
+            {
+                if(channels >= 3)
+                {
+                    pixel.r = src[0];
+                    pixel.g = src[1];
+                    pixel.b = src[2];
+                    pixel.a = channels == 4 ? src[3] : 255;
+                }
+                else
+                {
+                    pixel.r = pixel.g = pixel.b = src[0];
+                    pixel.a = channels == 2 ? src[1] : 255;
+                }
+
+                if(pixel == previous)
+                {
+                    run++;
+
+                    if(run == 62 || (last_row && col == view.width - 1))
+                    {
+                        *out++ = QOI_OP_RUN | (run - 1);
+                        run = 0;
+                    }
+                }
+                else
+                {
+                    if(run > 0)
+                    {
+                        *out++ = QOI_OP_RUN | (run - 1);
+                        run = 0;
+                    }
+
+                    int hash = pixel.hash();
+
+                    if(index[hash] == pixel)
+                    {
+                        *out++ = QOI_OP_INDEX | hash;
+                    }
+                    else
+                    {
+                        index[hash] = pixel;
+
+                        if(pixel.a == previous.a)
+                        {
+                            signed char dr = (signed char)(pixel.r - previous.r);
+                            signed char dg = (signed char)(pixel.g - previous.g);
+                            signed char db = (signed char)(pixel.b - previous.b);
+                            signed char dr_dg = (signed char)(dr - dg);
+                            signed char db_dg = (signed char)(db - dg);
+
+                            if(dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+                            {
+                                *out++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                            }
+                            else if(dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8)
+                            {
+                                *out++ = QOI_OP_LUMA | (dg + 32);
+                                *out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+                            }
+                            else
+                            {
+                                *out++ = QOI_OP_RGB;
+                                *out++ = pixel.r;
+                                *out++ = pixel.g;
+                                *out++ = pixel.b;
+                            }
+                        }
+                        else
+                        {
+                            *out++ = QOI_OP_RGBA;
+                            *out++ = pixel.r;
+                            *out++ = pixel.g;
+                            *out++ = pixel.b;
+                            *out++ = pixel.a;
+                        }
+                    }
+                }
+
+                previous = pixel;
+
+                if((size_t)(out - block.data()) >= block_size)
+                {
+                    flush();
+                }
+            }
+        }
+
+        memcpy(out, QOI_PADDING, sizeof(QOI_PADDING));
+        out += sizeof(QOI_PADDING);
+        flush();
+        return true;
+    }
+};
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include "af_parallel.h"
+#include "af_point_ops.h"
+
+
+namespace af
+{
+    // Fills dst with the width * channels bytes of a source row, may be called from several threads at once (for different rows)
+    using RowSource = std::function<void(int row, unsigned char* dst)>;
+
+    // Receives a finished output row, may be called from several threads at once and out of order
+    using RowSink = std::function<void(int row, const unsigned char* src)>;
+
+    // Memory used by a rolling convolution, everything is O(kernel height * width)
+    struct RollingKernelStats
+    {
+        int threads = 0;
+        int ring_rows = 0;          // Source rows every thread keeps (the kernel height)
+        size_t ring_bytes = 0;      // All ring buffers plus output rows
+        size_t halo_bytes = 0;      // Snapshot of the rows around the strip boundaries (in-place only)
+        size_t peak_bytes = 0;      // ring_bytes + halo_bytes
+    };
+
+
+    // A kernel flattened for convolving one row at a time: the weights row-major, the sum the results are divided by and the point-op tables
+    struct RowKernel
+    {
+        std::vector<float> weights;
+        int width = 0;
+        int height = 0;
+        float sum = 1;
+        const uint8_t* lut[4] = {nullptr, nullptr, nullptr, nullptr};
+
+        RowKernel(const std::vector<std::vector<float>> &kernel, const PointOps* point_ops)
+        {
+            height = (int)kernel.size();
+            width = height > 0 ? (int)kernel.at(0).size() : 0;
+            float kernel_sum = 0;
+
+            for(int kernel_row = 0; kernel_row < height; kernel_row++)
+            {
+                for(int kernel_col = 0; kernel_col < width; kernel_col++)
+                {
+                    weights.push_back(kernel.at(kernel_row).at(kernel_col));
+                    kernel_sum += kernel.at(kernel_row).at(kernel_col);
+                }
+            }
+
+            sum = kernel_sum == 0 ? 1 : kernel_sum;
+
+            if(point_ops != nullptr && !point_ops->isIdentity())
+            {
+                for(int c = 0; c < 4; c++)
+                {
+                    lut[c] = point_ops->getLut(c);
+                }
+            }
+        }
+
+        // Compute one output row from the kernel-height source rows around it, each padded by the horizontal radius on both sides.
+        // sums is scratch space for channels floats.
+        void apply(const unsigned char* const* rows, int row_width, int channels, float* sums, unsigned char* output) const
+        {
+            for(int col = 0; col < row_width; col++)
+            {
+                std::fill(sums, sums + channels, 0.0F);
+
+                for(int kernel_row = 0; kernel_row < height; kernel_row++)
+                {
+                    const unsigned char* pixel = rows[kernel_row] + col * channels;
+                    const float* weight = weights.data() + kernel_row * width;
+
+                    for(int kernel_col = 0; kernel_col < width; kernel_col++, pixel += channels)
+                    {
+                        for(int c = 0; c < channels; c++)
+                        {
+                            sums[c] += *(pixel + c) * weight[kernel_col];
+                        }
+                    }
+                }
+
+                for(int c = 0; c < channels; c++)
+                {
+                    int value = (int)(sums[c] / sum);
+                    value = value < 0 ? 0 : (value > 255 ? 255 : value);
+                    const uint8_t* table = c < 4 ? lut[PointOps::lutIndex(c, channels)] : nullptr;
+                    output[col * channels + c] = table != nullptr ? table[value] : (uint8_t)value;
+                }
+            }
+        }
+    };
+
+
+    // Mirror an index into [0, size), same scheme as padImageRgb
+    inline int mirrorIndex(int index, int size)
+    {
+        if(index < 0)
+        {
+            index = -index - 1;
+        }
+
+        if(index >= size)
+        {
+            index = 2 * size - index - 1;
+        }
+
+        return std::min(std::max(index, 0), size - 1);
+    }
+
+    // Convolve an image row by row without ever holding it: every thread walks its strip of rows top to bottom and keeps only the last
+    // kernel-height source rows (mirror padded) in a ring buffer. Edges are mirrored, the rounding is the one of Image::kernelThread.
+    // If in_place is set, the sink may overwrite the source rows: the rows within the kernel radius of every strip boundary are snapshotted
+    // before the threads start, so no thread reads a row another one has already written.
+    inline RollingKernelStats convolveRows(const std::vector<std::vector<float>> &kernel, int width, int height, int channels,
+                                           const RowSource &source, const RowSink &sink, bool in_place = false,
+                                           const PointOps* point_ops = nullptr, int thread_count = 0)
+    {
+        RollingKernelStats stats;
+
+        if(kernel.empty() || kernel.size() % 2 == 0 || kernel.at(0).size() % 2 == 0 || width <= 0 || height <= 0 || channels <= 0)
+        {
+            return stats;   // TODO: Error-handling
+        }
+
+        RowKernel row_kernel(kernel, point_ops);
+        int kernel_height = row_kernel.height;
+        int radius_y = (kernel_height - 1) / 2;
+        int radius_x = (row_kernel.width - 1) / 2;
+        int row_bytes = width * channels;
+        int padded_row_bytes = (width + radius_x * 2) * channels;
+        thread_count = thread_count > 0 ? thread_count : (int)std::thread::hardware_concurrency();
+        std::vector<int> bounds = stripBounds(0, height, thread_count);
+        int strips = (int)bounds.size() - 1;
+
+        // In-place: snapshot the source rows within radius_y of every inner strip boundary
+        std::vector<int> halo_index(in_place ? height : 0, -1);
+        std::vector<unsigned char> halo;
+
+        if(in_place)
+        {
+            int halo_rows = 0;
+
+            for(int i = 1; i < strips; i++)
+            {
+                for(int row = std::max(0, bounds.at(i) - radius_y); row < std::min(height, bounds.at(i) + radius_y); row++)
+                {
+                    if(halo_index.at(row) < 0)
+                    {
+                        halo_index.at(row) = halo_rows++;
+                    }
+                }
+            }
+
+            halo.resize((size_t)halo_rows * row_bytes);
+
+            for(int row = 0; row < height; row++)
+            {
+                if(halo_index.at(row) >= 0)
+                {
+                    source(row, halo.data() + (size_t)halo_index.at(row) * row_bytes);
+                }
+            }
+        }
+
+        stats.threads = strips;
+        stats.ring_rows = kernel_height;
+        stats.ring_bytes = (size_t)strips * ((size_t)kernel_height * padded_row_bytes + row_bytes);
+        stats.halo_bytes = halo.size();
+        stats.peak_bytes = stats.ring_bytes + stats.halo_bytes;
+
+        parallelRows(0, height, thread_count, [&](int, int start_row, int end_row) {
+            std::vector<unsigned char> ring((size_t)kernel_height * padded_row_bytes);
+            std::vector<unsigned char> output(row_bytes);
+            std::vector<float> sum(channels);
+            std::vector<const unsigned char*> rows(kernel_height);
+            int first_row = start_row - radius_y;   // Logical row stored in ring slot 0 at the start
+
+            auto slot = [&](int row) {
+                return ring.data() + (size_t)((row - first_row) % kernel_height) * padded_row_bytes;
+            };
+
+            // Bring a logical row (may lie outside the image) into its slot and mirror its left and right border
+            auto loadRow = [&](int row) {
+                unsigned char* dst = slot(row);
+                unsigned char* pixels = dst + radius_x * channels;
+
+                if(row >= height && row - (kernel_height - 1) >= first_row)
+                {
+                    // Bottom border: the mirrored row is still in the ring (and may already be overwritten in the image)
+                    memcpy(dst, slot(mirrorIndex(row, height)), padded_row_bytes);
+                    return;
+                }
+
+                int source_row = mirrorIndex(row, height);
+
+                if(in_place && halo_index.at(source_row) >= 0)
+                {
+                    memcpy(pixels, halo.data() + (size_t)halo_index.at(source_row) * row_bytes, row_bytes);
+                }
+                else
+                {
+                    source(source_row, pixels);
+                }
+
+                for(int col = 0; col < radius_x; col++)
+                {
+                    memcpy(dst + col * channels, pixels + mirrorIndex(col - radius_x, width) * channels, channels);
+                    memcpy(pixels + (width + col) * channels, pixels + mirrorIndex(width + col, width) * channels, channels);
+                }
+            };
+
+            for(int row = start_row - radius_y; row < start_row + radius_y; row++)
+            {
+                loadRow(row);
+            }
+
+            for(int row = start_row; row < end_row; row++)
+            {
+                loadRow(row + radius_y);
+
+                for(int kernel_row = 0; kernel_row < kernel_height; kernel_row++)
+                {
+                    rows[kernel_row] = slot(row - radius_y + kernel_row);
+                }
+
+                row_kernel.apply(rows.data(), width, channels, sum.data(), output.data());
+                sink(row, output.data());
+            }
+        });
+
+        return stats;
+    }
+
+    // Push-based rolling convolution for rows that arrive in order from a decoder or a pipe: pushRow() the source rows top to bottom,
+    // every output row goes to the sink as soon as the rows below it are in, finish() flushes the bottom border. Same edges and rounding
+    // as convolveRows, single-threaded, and it keeps only 2 * kernel-height rows.
+    class RollingConvolver
+    {
+    private:
+        RowKernel m_kernel;
+        RowSink m_sink;
+        int m_width = 0;
+        int m_height = 0;
+        int m_channels = 0;
+        int m_radius_x = 0;
+        int m_radius_y = 0;
+        int m_slots = 0;
+        int m_padded_row_bytes = 0;
+        int m_pushed = 0;       // Source rows received
+        int m_emitted = 0;      // Output rows sent to the sink
+        std::vector<unsigned char> m_ring;
+        std::vector<unsigned char> m_output;
+        std::vector<float> m_sums;
+        std::vector<const unsigned char*> m_rows;
+
+        // Slot of a logical row (-radius_y .. height + radius_y), rows above and below the image are the mirrored ones
+        unsigned char* slot(int row)
+        {
+            return m_ring.data() + (size_t)(((row % m_slots) + m_slots) % m_slots) * m_padded_row_bytes;
+        }
+
+        void storeRow(int row, const unsigned char* src)
+        {
+            unsigned char* dst = slot(row);
+            unsigned char* pixels = dst + m_radius_x * m_channels;
+            memcpy(pixels, src, (size_t)m_width * m_channels);
+
+            for(int col = 0; col < m_radius_x; col++)
+            {
+                memcpy(dst + col * m_channels, pixels + mirrorIndex(col - m_radius_x, m_width) * m_channels, m_channels);
+                memcpy(pixels + (m_width + col) * m_channels, pixels + mirrorIndex(m_width + col, m_width) * m_channels, m_channels);
+            }
+        }
+
+        void emitRow(int row)
+        {
+            for(int kernel_row = 0; kernel_row < m_kernel.height; kernel_row++)
+            {
+                m_rows[kernel_row] = slot(row - m_radius_y + kernel_row);
+            }
+
+            m_kernel.apply(m_rows.data(), m_width, m_channels, m_sums.data(), m_output.data());
+            m_sink(row, m_output.data());
+        }
+
+    public:
+        RollingConvolver(const std::vector<std::vector<float>> &kernel, int width, int height, int channels, const RowSink &sink,
+                         const PointOps* point_ops = nullptr) : m_kernel(kernel, point_ops)
+        {
+            if(kernel.empty() || kernel.size() % 2 == 0 || kernel.at(0).size() % 2 == 0 || width <= 0 || height <= 0 || channels <= 0)
+            {
+                return;     // TODO: Error-handling
+            }
+
+            m_sink = sink;
+            m_width = width;
+            m_height = height;
+            m_channels = channels;
+            m_radius_x = (m_kernel.width - 1) / 2;
+            m_radius_y = (m_kernel.height - 1) / 2;
+            m_slots = m_kernel.height * 2;
+            m_padded_row_bytes = (width + m_radius_x * 2) * channels;
+            m_ring.resize((size_t)m_slots * m_padded_row_bytes);
+            m_output.resize((size_t)width * channels);
+            m_sums.resize(channels);
+            m_rows.resize(m_kernel.height);
+        }
+
+        // Add the next source row (width * channels bytes)
+        void pushRow(const unsigned char* src)
+        {
+            if(m_ring.empty() || m_pushed >= m_height)
+            {
+                return;
+            }
+
+            int row = m_pushed++;
+            storeRow(row, src);
+
+            // The top border rows that mirror this one
+            for(int border = -m_radius_y; border < 0; border++)
+            {
+                if(mirrorIndex(border, m_height) == row)
+                {
+                    memcpy(slot(border), slot(row), m_padded_row_bytes);
+                }
+            }
+
+            // Every row whose neighbourhood is complete, the top border ones included
+            while(m_emitted + m_radius_y < m_pushed && m_emitted + m_radius_y < m_height)
+            {
+                emitRow(m_emitted++);
+            }
+        }
+
+        // Fill in the bottom border and send the remaining rows, call once all rows are pushed
+        void finish()
+        {
+            if(m_ring.empty() || m_pushed < m_height)
+            {
+                return;
+            }
+
+            for(int border = m_height; border < m_height + m_radius_y; border++)
+            {
+                memcpy(slot(border), slot(mirrorIndex(border, m_height)), m_padded_row_bytes);
+            }
+
+            while(m_emitted < m_height)
+            {
+                emitRow(m_emitted++);
+            }
+        }
+
+        // Bytes held for the rows in flight
+        size_t bufferBytes() const
+        {
+            return m_ring.size() + m_output.size();
+        }
+    };
+};